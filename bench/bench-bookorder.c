@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Runs bookorder over an order file end to end and reports what it cost as one
+ * line of JSON, so that runs can be appended to a file and compared over time.
+ *
+ * The orders are streamed into bookorder's standard input, and its summary
+ * lines are read back from its standard output. Each order is stamped when it
+ * is written; since bookorder applies every customer's orders in file order,
+ * the n-th summary line for a customer answers that customer's n-th order, and
+ * the time between the two is the order's latency. Peak RSS and CPU time come
+ * from wait4() once bookorder exits.
+ */
+
+/**
+ * The most bytes written to bookorder at once. Every order in a write is
+ * stamped with the time of that write.
+ */
+#define WRITESIZE 4096
+
+/**
+ * The order file, and where each of its lines starts.
+ */
+char *data;
+size_t length;
+size_t *starts;
+long num_orders;
+
+/**
+ * When each order was written, in nanoseconds, and how many orders have been
+ * stamped so far. The count is published after the stamps it covers.
+ */
+long long *sent;
+atomic_long num_sent;
+
+/**
+ * The write end of bookorder's standard input.
+ */
+int input;
+
+/**
+ * A customer's orders that have not been answered yet, as a chain through the
+ * next array, in an open-addressing table keyed by customer ID. An empty slot
+ * has a head of -2; a customer whose orders have all been answered, -1.
+ */
+typedef struct pending {
+    long customer_id;
+    long head;
+    long tail;
+} pending_t;
+
+pending_t *pending;
+size_t num_pending;
+long *next;
+
+/**
+ * Returns the time in nanoseconds.
+ */
+long long now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * Returns the pending entry for the customer, or the empty slot where it goes.
+ */
+pending_t *find_pending(long customer_id) {
+    size_t i = ((unsigned long) customer_id * 0x9E3779B97F4A7C15UL)
+               & (num_pending - 1);
+    while (pending[i].head != -2 && pending[i].customer_id != customer_id)
+        i = (i + 1) & (num_pending - 1);
+    return &pending[i];
+}
+
+/**
+ * Returns the customer ID of an order line: the field before the category, so
+ * that a '|' in the title does not matter.
+ */
+long line_customer(const char *line, const char *end) {
+    const char *p = end;
+    int bars = 0;
+    while (p > line && bars < 2) {
+        if (*--p == '|')
+            bars++;
+    }
+    return atol(p + 1);
+}
+
+/**
+ * Reads the order file and chains each order onto its customer. Returns -1 if
+ * the file cannot be read.
+ */
+int load_orders(const char *path) {
+    FILE *file;
+    char *p, *end, *newline;
+    long i, capacity, customer_id;
+    pending_t *entry;
+
+    if ((file = fopen(path, "r")) == NULL)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    rewind(file);
+    data = (char *) malloc(length + 1);
+    if (!data || fread(data, 1, length, file) != length) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    capacity = 1024;
+    starts = (size_t *) malloc(capacity * sizeof(size_t));
+    num_orders = 0;
+    end = data + length;
+    for (p = data; p < end; p = newline + 1) {
+        if ((newline = memchr(p, '\n', end - p)) == NULL)
+            newline = end;
+        if (newline == p)
+            continue;
+        if (num_orders == capacity) {
+            capacity *= 2;
+            starts = (size_t *) realloc(starts, capacity * sizeof(size_t));
+        }
+        starts[num_orders++] = p - data;
+    }
+
+    for (num_pending = 1024; num_pending < 2 * (size_t) num_orders; )
+        num_pending *= 2;
+    pending = (pending_t *) malloc(num_pending * sizeof(pending_t));
+    next = (long *) malloc(num_orders * sizeof(long));
+    sent = (long long *) malloc(num_orders * sizeof(long long));
+    for (i = 0; i < (long) num_pending; i++) {
+        pending[i].head = -2;
+    }
+    for (i = 0; i < num_orders; i++) {
+        p = data + starts[i];
+        newline = memchr(p, '\n', end - p);
+        customer_id = line_customer(p, newline ? newline : end);
+        entry = find_pending(customer_id);
+        if (entry->head == -2) {
+            entry->customer_id = customer_id;
+            entry->head = i;
+        }
+        else {
+            next[entry->tail] = i;
+        }
+        entry->tail = i;
+        next[i] = -1;
+    }
+    return 0;
+}
+
+/**
+ * Code for the writer thread, which streams the orders into bookorder a few
+ * kilobytes at a time, whole lines only, then closes its input.
+ */
+void *writer_thread(void *args) {
+    size_t offset, end;
+    long first, last, i;
+    long long stamp;
+    ssize_t written;
+
+    for (first = 0; first < num_orders; first = last) {
+        // Take as many whole lines as fit, and at least one
+        offset = starts[first];
+        last = first + 1;
+        while (last < num_orders && starts[last] - offset < WRITESIZE)
+            last++;
+        if (last > first + 1 && last < num_orders
+                && starts[last] - offset > WRITESIZE)
+            last--;
+        end = last < num_orders ? starts[last] : length;
+
+        stamp = now();
+        for (i = first; i < last; i++) {
+            sent[i] = stamp;
+        }
+        atomic_store_explicit(&num_sent, last, memory_order_release);
+        while (offset < end) {
+            if ((written = write(input, data + offset, end - offset)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                close(input);
+                return NULL;
+            }
+            offset += written;
+        }
+    }
+    close(input);
+    return NULL;
+}
+
+int compare_latency(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+void print_usage(void) {
+    fprintf(stderr,
+            "Usage: bench-bookorder [options] <database file> <order file> "
+            "<categories> [bookorder options]\n"
+            "\t-p path = the bookorder program (default ./bookorder)\n"
+            "\t-l label = a label for the run, such as a commit\n");
+}
+
+int main(int argc, char **argv) {
+    const char *program = "./bookorder", *label = "";
+    char **child_argv, *line;
+    int to_child[2], from_child[2], opt, status, i, n;
+    long long *latencies, started, finished, stamp;
+    long answered, index, customer_id;
+    size_t size;
+    pending_t *entry;
+    pthread_t writer;
+    struct rusage usage;
+    double seconds, cpu;
+    FILE *output;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "+p:l:")) != -1) {
+        switch (opt) {
+        case 'p':
+            program = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind < 3) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    if (load_orders(argv[optind + 1]) != 0) {
+        fprintf(stderr, "Error: could not read %s\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    latencies = (long long *) malloc((num_orders + 1) * sizeof(long long));
+
+    // bookorder -o summary [options] database - categories
+    child_argv = (char **) calloc(argc + 4, sizeof(char *));
+    n = 0;
+    child_argv[n++] = (char *) program;
+    child_argv[n++] = "-o";
+    child_argv[n++] = "summary";
+    for (i = optind + 3; i < argc; i++) {
+        child_argv[n++] = argv[i];
+    }
+    child_argv[n++] = argv[optind];
+    child_argv[n++] = "-";
+    child_argv[n++] = argv[optind + 2];
+
+    if (pipe(to_child) != 0 || pipe(from_child) != 0) {
+        perror("bench-bookorder");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    started = now();
+    if ((pid = fork()) == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        execv(program, child_argv);
+        perror(program);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("bench-bookorder");
+        return EXIT_FAILURE;
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    input = to_child[1];
+    pthread_create(&writer, NULL, writer_thread, NULL);
+
+    // Match every summary line to its customer's oldest unanswered order
+    output = fdopen(from_child[0], "r");
+    line = NULL;
+    size = 0;
+    answered = 0;
+    finished = started;
+    while (getline(&line, &size, output) != -1) {
+        if (strncmp(line, "OK|", 3) != 0 && strncmp(line, "REJECTED|", 9) != 0)
+            continue;
+        stamp = now();
+        customer_id = atol(strchr(line, '|') + 1);
+        entry = find_pending(customer_id);
+        if (entry->head < 0)
+            continue;
+        index = entry->head;
+        entry->head = next[index];
+        if (index >= atomic_load_explicit(&num_sent, memory_order_acquire))
+            continue;
+        latencies[answered++] = stamp - sent[index];
+        finished = stamp;
+    }
+    fclose(output);
+    free(line);
+    pthread_join(writer, NULL);
+    wait4(pid, &status, 0, &usage);
+
+    seconds = (finished - started) / 1e9;
+    cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+          + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    qsort(latencies, answered, sizeof(long long), compare_latency);
+    latencies[answered] = 0;
+
+    printf("{\"label\": \"%s\", \"orders\": %ld, \"answered\": %ld, "
+           "\"seconds\": %.6f, \"orders_per_second\": %.0f, "
+           "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+           "\"peak_rss_kb\": %ld, \"cpu_seconds\": %.6f, "
+           "\"cpu_utilization\": %.3f, \"exit_status\": %d}\n",
+           label, num_orders, answered, seconds,
+           seconds > 0 ? answered / seconds : 0.0,
+           latencies[answered / 2] / 1e3,
+           latencies[answered ? (answered * 99) / 100 : 0] / 1e3,
+           latencies[answered ? answered - 1 : 0] / 1e3,
+           usage.ru_maxrss, cpu, seconds > 0 ? cpu / seconds : 0.0,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+
+    free(latencies);
+    free(child_argv);
+    free(data);
+    free(starts);
+    free(pending);
+    free(next);
+    free(sent);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0
+           && answered == num_orders ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,253 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../node.h"
+#include "../queue.h"
+
+/**
+ * Measures the queue on its own, as a linked list and as a ring buffer, with 1
+ * to 4 producers against 1 to 4 consumers. Consumers take items with the
+ * blocking pop, with batches, or (on the list) by peeking at the head under the
+ * mutex and only dequeuing their own items, as the old per-category consumers
+ * did. Producers can spin between items to lower the offered rate. Besides
+ * throughput, it reports how long items waited in the queue, from just before
+ * the enqueue to just after the dequeue.
+ */
+
+#define RINGCAPACITY 4096
+
+#define BATCHSIZE 16
+
+#define MAXTHREADS 4
+
+typedef enum bench_mode {
+    MODE_POP,
+    MODE_BATCH,
+    MODE_PEEK
+} bench_mode_t;
+
+const char *mode_names[] = {"pop", "batch", "peek"};
+
+/**
+ * Number of busy-work iterations each producer spends between two items.
+ */
+long work_per_item;
+
+/**
+ * Keeps the compiler from optimizing the busy work away.
+ */
+volatile unsigned long sink;
+
+/**
+ * One run in progress. Each item is a slot in stamps, holding the time it was
+ * enqueued in nanoseconds; slots are laid out by producer so that consumers in
+ * the peek mode can tell whose item they are looking at.
+ */
+typedef struct run {
+    queue_t *queue;
+    bench_mode_t mode;
+    int producers;
+    int consumers;
+    long items;
+    long *stamps;
+    long *latencies[MAXTHREADS];
+    long taken[MAXTHREADS];
+} run_t;
+
+typedef struct worker {
+    run_t *run;
+    int index;
+} worker_t;
+
+long now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int compare_longs(const void *a, const void *b) {
+    long x = *((const long *) a), y = *((const long *) b);
+    return (x > y) - (x < y);
+}
+
+void *producer_thread(void *args) {
+    worker_t *worker = (worker_t *) args;
+    run_t *run = worker->run;
+    long *slots = run->stamps + worker->index * run->items;
+    void *batch[BATCHSIZE];
+    unsigned long x = worker->index;
+    long i, j, k;
+
+    for (i = 0; i < run->items; i += BATCHSIZE) {
+        for (j = 0; j < BATCHSIZE && i + j < run->items; j++) {
+            for (k = 0; k < work_per_item; k++) {
+                x = x * 6364136223846793005UL + 1442695040888963407UL;
+            }
+            batch[j] = &slots[i + j];
+            if (run->mode != MODE_BATCH) {
+                slots[i + j] = now();
+                if (run->mode == MODE_PEEK) {
+                    pthread_mutex_lock(&run->queue->mutex);
+                    queue_enqueue(run->queue, batch[j]);
+                    pthread_cond_broadcast(&run->queue->nonempty);
+                    pthread_mutex_unlock(&run->queue->mutex);
+                }
+                else {
+                    queue_push(run->queue, batch[j]);
+                }
+            }
+        }
+        if (run->mode == MODE_BATCH) {
+            long stamp = now();
+            for (k = 0; k < j; k++) {
+                *((long *) batch[k]) = stamp;
+            }
+            queue_enqueue_batch(run->queue, batch, j);
+        }
+    }
+    sink += x;
+    return NULL;
+}
+
+void *consumer_thread(void *args) {
+    worker_t *worker = (worker_t *) args;
+    run_t *run = worker->run;
+    queue_t *queue = run->queue;
+    long *latencies = run->latencies[worker->index];
+    long taken = 0, stamp;
+    void *batch[BATCHSIZE], *item;
+    size_t count, i;
+    int owner;
+
+    for (;;) {
+        if (run->mode == MODE_POP) {
+            if ((item = queue_pop(queue)) == NULL)
+                break;
+            latencies[taken++] = now() - *((long *) item);
+        }
+        else if (run->mode == MODE_BATCH) {
+            if ((count = queue_dequeue_batch(queue, batch, BATCHSIZE)) == 0)
+                break;
+            stamp = now();
+            for (i = 0; i < count; i++) {
+                latencies[taken++] = stamp - *((long *) batch[i]);
+            }
+        }
+        else {
+            pthread_mutex_lock(&queue->mutex);
+            while (!queue->closed && queue_isempty(queue)) {
+                pthread_cond_wait(&queue->nonempty, &queue->mutex);
+            }
+            if (queue_isempty(queue)) {
+                pthread_mutex_unlock(&queue->mutex);
+                break;
+            }
+            item = (void *) queue_peek(queue);
+            owner = ((long *) item - run->stamps) / run->items;
+            if (owner % run->consumers != worker->index) {
+                pthread_mutex_unlock(&queue->mutex);
+                sched_yield();
+                continue;
+            }
+            queue_dequeue(queue);
+            pthread_mutex_unlock(&queue->mutex);
+            latencies[taken++] = now() - *((long *) item);
+        }
+    }
+    run->taken[worker->index] = taken;
+    return NULL;
+}
+
+/**
+ * Runs the given producers against the given consumers and prints a line with
+ * the throughput and the median and tail time in the queue.
+ */
+void bench(int ring, bench_mode_t mode, int producers, int consumers,
+           long items) {
+    pthread_t threads[2 * MAXTHREADS];
+    worker_t workers[2 * MAXTHREADS];
+    long total = producers * items, merged = 0, start, elapsed, *all;
+    run_t run;
+    int t;
+
+    run.queue = ring ? queue_create_ring(RINGCAPACITY) : queue_create();
+    run.mode = mode;
+    run.producers = producers;
+    run.consumers = consumers;
+    run.items = items;
+    run.stamps = (long *) malloc(total * sizeof(long));
+    for (t = 0; t < consumers; t++) {
+        run.latencies[t] = (long *) malloc(total * sizeof(long));
+    }
+
+    start = now();
+    for (t = 0; t < producers + consumers; t++) {
+        workers[t].run = &run;
+        workers[t].index = t < producers ? t : t - producers;
+        pthread_create(&threads[t], NULL,
+                       t < producers ? producer_thread : consumer_thread,
+                       &workers[t]);
+    }
+    for (t = 0; t < producers; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    queue_close(run.queue);
+    for (t = producers; t < producers + consumers; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    elapsed = now() - start;
+
+    all = (long *) malloc(total * sizeof(long));
+    for (t = 0; t < consumers; t++) {
+        memcpy(all + merged, run.latencies[t], run.taken[t] * sizeof(long));
+        merged += run.taken[t];
+        free(run.latencies[t]);
+    }
+    qsort(all, merged, sizeof(long), compare_longs);
+
+    printf("%-5s %-6s %9d %9d %14.0f %12.2f %12.2f%s\n",
+           ring ? "ring" : "list", mode_names[mode], producers, consumers,
+           merged / (elapsed / 1e9),
+           merged ? all[merged / 2] / 1e3 : 0.0,
+           merged ? all[merged * 99 / 100] / 1e3 : 0.0,
+           merged == total ? "" : "  (items lost)");
+
+    free(all);
+    free(run.stamps);
+    queue_destroy(run.queue, NULL);
+}
+
+int main(int argc, char **argv) {
+    long items;
+    int ring, mode, producers, consumers;
+
+    items = argc > 1 ? atol(argv[1]) : 200000;
+    work_per_item = argc > 2 ? atol(argv[2]) : 0;
+
+    printf("# %ld items per producer, %ld work iterations between items\n",
+           items, work_per_item);
+    printf("# latency is microseconds from enqueue to dequeue\n");
+    printf("%-5s %-6s %9s %9s %14s %12s %12s\n", "queue", "mode",
+           "producers", "consumers", "items/s", "p50 latency", "p99 latency");
+    for (ring = 0; ring <= 1; ring++) {
+        for (mode = MODE_POP; mode <= MODE_PEEK; mode++) {
+            // Peeking is only safe under the list's mutex
+            if (ring && mode == MODE_PEEK)
+                continue;
+            for (producers = 1; producers <= MAXTHREADS; producers *= 2) {
+                for (consumers = 1; consumers <= MAXTHREADS; consumers *= 2) {
+                    bench(ring, mode, producers, consumers,
+                          mode == MODE_PEEK ? items / 4 : items);
+                }
+            }
+        }
+    }
+
+    node_pool_destroy();
+    return EXIT_SUCCESS;
+}
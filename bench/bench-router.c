@@ -0,0 +1,240 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "../books.h"
+#include "../queue.h"
+#include "../router.h"
+
+/**
+ * Measures order throughput as the number of categories grows, comparing the
+ * per-category router (with linked-list and ring buffer queues) against the old
+ * single shared queue, where consumers peek at the head and yield when the
+ * order belongs to someone else. Besides throughput, it reports what each order
+ * costs in CPU time and context switches, which shows the yielding consumers
+ * burning CPU while they wait for their orders.
+ */
+
+#define RINGCAPACITY 4096
+
+#define MAXBENCHCATEGORIES 64
+
+/**
+ * Number of busy-work iterations each consumer spends on one order.
+ */
+long work_per_order;
+
+/**
+ * Keeps the compiler from optimizing the busy work away.
+ */
+volatile unsigned long sink;
+
+/**
+ * The router under test, or NULL when benchmarking the shared queue.
+ */
+router_t *router;
+
+/**
+ * The shared queue and its done flag, used by the baseline.
+ */
+queue_t *shared;
+int shared_done;
+
+char *category_names[MAXBENCHCATEGORIES];
+int category_indices[MAXBENCHCATEGORIES];
+
+/**
+ * What one run cost: wall-clock and CPU seconds, and the context switches of
+ * every thread in the process.
+ */
+typedef struct result {
+    double seconds;
+    double cpu;
+    long switches;
+} result_t;
+
+/**
+ * Returns the CPU time used so far, in seconds, and stores the number of
+ * voluntary and involuntary context switches.
+ */
+double cpu_seconds(long *switches) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *switches = usage.ru_nvcsw + usage.ru_nivcsw;
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+           + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Stands in for the customer lookup and credit check.
+ */
+void process(order_t *order) {
+    long i;
+    unsigned long x = (unsigned long) order->customer_id;
+    for (i = 0; i < work_per_order; i++) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    }
+    sink += x;
+    order_destroy(order);
+}
+
+void *router_consumer(void *args) {
+    order_t *orders[MAXBATCH];
+    size_t count, i;
+    int index = *((int *) args);
+    while ((count = router_dequeue_batch(router, index, orders,
+                                         MAXBATCH)) > 0) {
+        for (i = 0; i < count; i++) {
+            process(orders[i]);
+        }
+    }
+    return NULL;
+}
+
+void *shared_consumer(void *args) {
+    int category = *((int *) args);
+    order_t *order;
+
+    for (;;) {
+        pthread_mutex_lock(&shared->mutex);
+        while (!shared_done && queue_isempty(shared)) {
+            pthread_cond_wait(&shared->nonempty, &shared->mutex);
+        }
+        if (queue_isempty(shared)) {
+            pthread_mutex_unlock(&shared->mutex);
+            return NULL;
+        }
+        order = (order_t *) queue_peek(shared);
+        if (order->category_id != category) {
+            pthread_mutex_unlock(&shared->mutex);
+            sched_yield();
+            continue;
+        }
+        order = (order_t *) queue_dequeue(shared);
+        pthread_mutex_unlock(&shared->mutex);
+        process(order);
+    }
+}
+
+/**
+ * Runs one producer and one consumer per category over the given number of
+ * orders, spread round-robin over the categories, and returns its cost.
+ */
+result_t run(int use_router, size_t capacity, int num_categories,
+             long num_orders) {
+    result_t result;
+    long i, switches;
+    double cpu;
+    int c;
+    order_t *order;
+    pthread_t tid[MAXBENCHCATEGORIES];
+    struct timespec start, end;
+
+    if (use_router) {
+        router = router_create(category_names, num_categories, capacity);
+    }
+    else {
+        shared = queue_create();
+        shared_done = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cpu = cpu_seconds(&switches);
+    for (c = 0; c < num_categories; c++) {
+        pthread_create(&tid[c], NULL,
+                       use_router ? router_consumer : shared_consumer,
+                       &category_indices[c]);
+    }
+
+    for (i = 0; i < num_orders; i++) {
+        order = order_create("bench", MONEY_SCALE, i,
+                             category_names[i % num_categories]);
+        order->category_id = i % num_categories;
+        if (use_router) {
+            router_enqueue(router, order);
+        }
+        else {
+            pthread_mutex_lock(&shared->mutex);
+            queue_enqueue(shared, order);
+            pthread_mutex_unlock(&shared->mutex);
+            pthread_cond_signal(&shared->nonempty);
+        }
+    }
+
+    if (use_router) {
+        router_finish(router);
+    }
+    else {
+        pthread_mutex_lock(&shared->mutex);
+        shared_done = 1;
+        pthread_cond_broadcast(&shared->nonempty);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+
+    for (c = 0; c < num_categories; c++) {
+        pthread_join(tid[c], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result.cpu = cpu_seconds(&result.switches) - cpu;
+    result.switches -= switches;
+
+    if (use_router)
+        router_destroy(router);
+    else
+        queue_destroy(shared, NULL);
+
+    result.seconds = (end.tv_sec - start.tv_sec)
+                     + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return result;
+}
+
+int main(int argc, char **argv) {
+    char name[32];
+    result_t router_result, ring_result, shared_result;
+    int c, max_categories;
+    long num_orders;
+
+    num_orders = argc > 1 ? atol(argv[1]) : 200000;
+    work_per_order = argc > 2 ? atol(argv[2]) : 500;
+    max_categories = argc > 3 ? atoi(argv[3]) : 32;
+    if (max_categories > MAXBENCHCATEGORIES)
+        max_categories = MAXBENCHCATEGORIES;
+
+    for (c = 0; c < MAXBENCHCATEGORIES; c++) {
+        snprintf(name, sizeof(name), "CATEGORY%02d", c);
+        category_names[c] = strdup(name);
+        category_indices[c] = c;
+    }
+
+    printf("# %ld orders, %ld work iterations per order\n",
+           num_orders, work_per_order);
+    printf("# CPU is microseconds per order; switches are context switches\n"
+           "# per thousand orders\n");
+    printf("%-10s %14s %14s %14s %8s %10s %10s %10s %10s\n", "categories",
+           "router ord/s", "ring ord/s", "shared ord/s", "speedup",
+           "router cpu", "shared cpu", "router sw", "shared sw");
+    for (c = 1; c <= max_categories; c *= 2) {
+        router_result = run(1, 0, c, num_orders);
+        ring_result = run(1, RINGCAPACITY, c, num_orders);
+        shared_result = run(0, 0, c, num_orders);
+        printf("%-10d %14.0f %14.0f %14.0f %7.2fx %10.3f %10.3f %10.2f "
+               "%10.2f\n", c,
+               num_orders / router_result.seconds,
+               num_orders / ring_result.seconds,
+               num_orders / shared_result.seconds,
+               shared_result.seconds / router_result.seconds,
+               router_result.cpu * 1e6 / num_orders,
+               shared_result.cpu * 1e6 / num_orders,
+               router_result.switches * 1e3 / num_orders,
+               shared_result.switches * 1e3 / num_orders);
+    }
+
+    for (c = 0; c < MAXBENCHCATEGORIES; c++) {
+        free(category_names[c]);
+    }
+    return EXIT_SUCCESS;
+}
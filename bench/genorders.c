@@ -0,0 +1,187 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Writes a synthetic customer database and order file for benchmarking, in the
+ * same formats as the files in files/, and prints the categories used as one
+ * line that can be passed to bookorder.
+ *
+ * Customers and categories are drawn from Zipf distributions, so a few
+ * customers place most of the orders and a few categories get most of them;
+ * a skew of zero draws them uniformly. Every order names a customer in the
+ * database and one of the categories printed, so none are skipped. The output
+ * depends only on the options and the seed.
+ */
+
+/**
+ * The state of the random number generator.
+ */
+uint64_t state;
+
+/**
+ * Returns the next number from a splitmix64 generator.
+ */
+uint64_t next_random(void) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Returns a uniform random number in [0, 1).
+ */
+double next_uniform(void) {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Builds the cumulative distribution of a Zipf distribution over n items with
+ * the given exponent. Returns NULL if memory allocation fails.
+ */
+double *zipf_create(long n, double skew) {
+    double *cdf, total = 0.0;
+    long i;
+
+    if ((cdf = (double *) malloc(n * sizeof(double))) == NULL)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        total += 1.0 / pow(i + 1, skew);
+        cdf[i] = total;
+    }
+    for (i = 0; i < n; i++) {
+        cdf[i] /= total;
+    }
+    return cdf;
+}
+
+/**
+ * Draws an index from the distribution by binary search.
+ */
+long zipf_next(const double *cdf, long n) {
+    double u = next_uniform();
+    long low = 0, high = n - 1, middle;
+
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (cdf[middle] < u)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void print_usage(void) {
+    fprintf(stderr,
+            "Usage: genorders [options] <database file> <order file>\n"
+            "\t-c n = number of customers (default 1000)\n"
+            "\t-n n = number of orders (default 100000)\n"
+            "\t-k n = number of categories (default 8)\n"
+            "\t-t n = number of distinct titles (default 1000)\n"
+            "\t-s x = Zipf skew of customer popularity (default 1.0)\n"
+            "\t-S x = Zipf skew of the category mix (default 0.5)\n"
+            "\t-r n = random seed (default 1)\n");
+}
+
+int main(int argc, char **argv) {
+    FILE *database, *orders;
+    double *customer_cdf, *category_cdf, customer_skew, category_skew;
+    long num_customers, num_orders, num_categories, num_titles, i;
+    long customer, category, credit, title;
+    long *prices;
+    int opt;
+
+    num_customers = 1000;
+    num_orders = 100000;
+    num_categories = 8;
+    num_titles = 1000;
+    customer_skew = 1.0;
+    category_skew = 0.5;
+    state = 1;
+    while ((opt = getopt(argc, argv, "c:n:k:t:s:S:r:")) != -1) {
+        switch (opt) {
+        case 'c':
+            num_customers = atol(optarg);
+            break;
+        case 'n':
+            num_orders = atol(optarg);
+            break;
+        case 'k':
+            num_categories = atol(optarg);
+            break;
+        case 't':
+            num_titles = atol(optarg);
+            break;
+        case 's':
+            customer_skew = atof(optarg);
+            break;
+        case 'S':
+            category_skew = atof(optarg);
+            break;
+        case 'r':
+            state = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2 || num_customers < 1 || num_orders < 0
+            || num_categories < 1 || num_titles < 1) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    customer_cdf = zipf_create(num_customers, customer_skew);
+    category_cdf = zipf_create(num_categories, category_skew);
+    prices = (long *) malloc(num_titles * sizeof(long));
+    if (!customer_cdf || !category_cdf || !prices) {
+        fprintf(stderr, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if ((database = fopen(argv[optind], "w")) == NULL
+            || (orders = fopen(argv[optind + 1], "w")) == NULL) {
+        perror("genorders");
+        return EXIT_FAILURE;
+    }
+
+    // Credit limits from $50 to $5000, so some orders are rejected. The
+    // random numbers are drawn one statement at a time, so that the output
+    // does not depend on the order the compiler evaluates arguments in.
+    for (i = 0; i < num_customers; i++) {
+        credit = 5000 + (long) (next_random() % 495001);
+        fprintf(database, "\"Customer %ld\"| %ld| %ld.%02ld| \"%ld Main St\"| "
+                "\"New Jersey\"| \"08854\"\n", i + 1, i + 1,
+                credit / 100, credit % 100, i + 1);
+    }
+
+    // Each title has one price, from $0.99 to $59.99
+    for (i = 0; i < num_titles; i++) {
+        prices[i] = 99 + (long) (next_random() % 5901);
+    }
+    for (i = 0; i < num_orders; i++) {
+        title = (long) (next_random() % num_titles);
+        customer = zipf_next(customer_cdf, num_customers) + 1;
+        category = zipf_next(category_cdf, num_categories);
+        fprintf(orders, "\"Book %ld\"|%ld.%02ld|%ld|CAT%ld\n", title,
+                prices[title] / 100, prices[title] % 100, customer, category);
+    }
+
+    if (fclose(database) != 0 || fclose(orders) != 0) {
+        perror("genorders");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < num_categories; i++) {
+        printf(i ? " CAT%ld" : "CAT%ld", i);
+    }
+    printf("\n");
+
+    free(customer_cdf);
+    free(category_cdf);
+    free(prices);
+    return EXIT_SUCCESS;
+}
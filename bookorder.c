@@ -1,10 +1,42 @@
-#include <sched.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "node.h"
+#include "output.h"
 #include "queue.h"
 #include "books.h"
+#include "category.h"
+#include "parse.h"
+#include "pool.h"
+#include "scan.h"
+#include "shard.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "stream.h"
+#include "wal.h"
+
+/**
+ * The default number of parsed orders that may wait to be applied. This keeps
+ * memory flat however long the order file is, while leaving the workers
+ * plenty of customers to choose from.
+ */
+#define DEFAULT_MAX_INFLIGHT 65536
+
+/**
+ * The defaults for the write-ahead log: sync once this many orders have been
+ * logged, or once the oldest unsynced one has waited this many milliseconds,
+ * and take a checkpoint every so many orders.
+ */
+#define DEFAULT_WAL_SYNC 256
+#define DEFAULT_WAL_SYNC_MS 10
+#define DEFAULT_CHECKPOINT 1000000
 
 /**
  * The database containing all customer information.
@@ -12,20 +44,64 @@
 database_t *customerDatabase;
 
 /**
- * The megaqueue holding all the book orders to be processed.
+ * The worker pool that applies the book orders.
+ */
+pool_t *pool;
+
+/**
+ * The shards that apply the book orders instead of the pool, if -s was given.
+ * Each shard owns its customers outright, so no customer is ever locked.
+ */
+shards_t *shards;
+
+/**
+ * The categories given on the command line, each with a dense ID that indexes
+ * the per-category counts.
+ */
+category_table_t *categories;
+int num_categories;
+
+/**
+ * Where the workers send their order confirmations and rejections, through
+ * one buffer per worker.
+ */
+output_t *output;
+output_buffer_t **buffers;
+
+/**
+ * The number of orders each worker has processed and rejected, per category.
+ * Row w belongs to worker w, so the workers never share a counter.
+ */
+long **processed;
+long **rejected;
+
+/**
+ * The number of threads parsing the order file.
+ */
+int num_producers;
+
+/**
+ * The order stream read by the producer when the order file is not mapped.
+ */
+stream_t *order_stream;
+
+/**
+ * The number of seconds between incremental reports, or zero to only report
+ * on SIGUSR1.
  */
-queue_t *queue;
+double report_interval;
 
 /**
- * This value is zero if the consumer thread is still working and set to one
- * once it completes execution.
+ * Set once the reporter thread should exit.
  */
-int is_done;
+atomic_int reporter_done;
 
 /**
- * All of the input categories, but formatted as one string.
+ * The write-ahead log of applied orders, or NULL if there is none, and what
+ * was recovered from it at startup.
  */
-char *input_categories;
+wal_t *order_log;
+wal_recovery_t recovery;
 
 /**
  * Returns a positive number if the filename points to a readable File
@@ -47,170 +123,506 @@ int is_file(char *filepath) {
  * Prints appropriate usage of this application to standard out.
  */
 void print_usage() {
-    printf("./bookorder <db> <orders> <cats> \n"
+    printf("./bookorder [options] <db> <orders> <cats> \n"
+           "\t-m = memory map the order file and parse it in place\n"
+           "\t-j n = parse the order file with n threads (implies -m)\n"
+           "\t-o mode = per-order output: full (default), summary or none\n"
+           "\t-v = print statistics to standard error at exit\n"
+           "\t--measure = print the CPU time and context switches per\n"
+           "\t       applied order to standard error at exit\n"
+           "\t-w n = apply the orders with n worker threads (default: one\n"
+           "\t       per online processor)\n"
+           "\t-s n = apply the orders on n shard threads instead, each\n"
+           "\t       owning the customers whose ID modulo n is its number;\n"
+           "\t       no customer is locked, but incremental reports, --wal\n"
+           "\t       and --max-inflight-bytes are not available\n"
+           "\t-f = follow the order file as it grows, like tail -f, and keep\n"
+           "\t       a named pipe open between writers, until SIGTERM\n"
+           "\t-i seconds = write an incremental report every interval; one\n"
+           "\t       is also written on SIGUSR1\n"
+           "\t--max-inflight n = hold at most n parsed orders that have not\n"
+           "\t       been applied yet (default: %d, 0 = no limit)\n"
+           "\t--max-inflight-bytes n = hold at most n bytes of such orders;\n"
+           "\t       K, M and G suffixes are accepted (default: no limit)\n"
+           "\t--wal path = log every applied order to path.N and checkpoint\n"
+           "\t       the balances to path.ckpt; a rerun with the same log\n"
+           "\t       resumes after the last order that was logged\n"
+           "\t--wal-sync n = sync the log every n orders (default: %d,\n"
+           "\t       0 = never sync, leaving it to the operating system)\n"
+           "\t--wal-sync-ms ms = sync the log at least every ms\n"
+           "\t       milliseconds while orders arrive (default: %d)\n"
+           "\t--checkpoint n = checkpoint every n orders (default: %d,\n"
+           "\t       0 = only at exit)\n"
            "\t<db> = the name of the database input file\n"
-           "\t<orders> = the name of the book order input file\n"
-           "\t<cats> = a quoted list of category names, separated by spaces\n");
+           "\t<orders> = the name of the book order input file, or - to\n"
+           "\t       read the orders from standard input\n"
+           "\t<cats> = a quoted list of category names, separated by spaces\n",
+           DEFAULT_MAX_INFLIGHT, DEFAULT_WAL_SYNC, DEFAULT_WAL_SYNC_MS,
+           DEFAULT_CHECKPOINT);
 }
 
 
 /**
- * Code for the consumer threads. They take the orders and process them. The
- * argument to this function should be a null-terminated string representing the
- * category name for this thread.
+ * Parses a non-negative size with an optional K, M or G suffix. Returns -1 if
+ * the string is not a valid size.
  */
-void *consumer_thread(void *args) {
-    char *category, *input;
+long parse_size(const char *string) {
+    char *end;
+    long size = strtol(string, &end, 10);
+    if (end == string || size < 0)
+        return -1;
+    switch (*end) {
+    case 'k': case 'K':
+        size <<= 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        size <<= 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        size <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+
+/**
+ * Parses a non-negative decimal integer with no suffix. Returns -1 if the
+ * string is not one.
+ */
+long parse_count(const char *string) {
+    char *end;
+    long count;
+
+    errno = 0;
+    count = strtol(string, &end, 10);
+    if (end == string || *end != '\0' || count < 0 || errno == ERANGE)
+        return -1;
+    return count;
+}
+
+
+/**
+ * Processes a single order: finds the customer, then, under the customer's lock
+ * stripe, checks their credit, adds a receipt for the order whether it
+ * succeeded or failed, debits the price if it succeeded and, with a write-ahead
+ * log, appends the order to the log, so that each customer's orders are logged
+ * in the order they were applied. The receipt is added before the debit so that
+ * a failed allocation leaves the customer untouched. A shard owns its customers
+ * outright, so with shards no stripe is taken. Once the stripe is released, the
+ * confirmation or rejection is formatted into the worker's output buffer, which
+ * is flushed before the customer can move to another worker. This is called by
+ * the worker pool, or by the customer's shard, and destroys the order.
+ */
+void process_order(order_t *order, int worker) {
+    output_buffer_t **buffer = &buffers[worker];
     customer_t *customer;
-    order_t *order;
-    receipt_t *receipt;
+    receipt_t receipt;
+    money_t credit;
+    int approved;
 
-    // Get the category for this thread.
-    input = (char *) args;
-    category = (char *) malloc(strlen(input) + 1);
-    strcpy(category, input);
+    customer = database_retrieve_customer(customerDatabase,
+                                          order->customer_id);
+    if (!customer) {
+        // Invalid customer ID
+        fprintf(stderr, "There is no customer in the database with"
+                "customer ID %ld.\n", order->customer_id);
+        order_destroy(order);
+        return;
+    }
 
-    while (!is_done || !queue_isempty(queue)) {
-        // We wait until there is something in the queue
-        pthread_mutex_lock(&queue->mutex);
+    receipt.title_id = order->title_id;
+    receipt.price = order->price;
 
-        if (!is_done && queue_isempty(queue)) {
-            pthread_cond_wait(&queue->nonempty, &queue->mutex);
-        }
+    if (!shards)
+        database_lock_customer(customerDatabase, customer);
+    approved = customer->credit_limit >= order->price;
+    receipt.remaining_credit = customer->credit_limit - order->price;
+    receipt.successful = approved;
+    // Add the receipt first, so that a failure leaves the customer untouched
+    if (customer_add_receipt(customer, &receipt) != 0) {
+        fprintf(stderr, "Error: could not allocate a receipt for customer "
+                "%ld.\n", customer->customer_id);
+        exit(EXIT_FAILURE);
+    }
+    if (approved) {
+        // Subtract price from remaining credit
+        customer->credit_limit -= order->price;
+        customer->spent += order->price;
+        customer->changed = 1;
+    }
+    customer->last_sequence = order->sequence;
+    if (order_log) {
+        wal_append(order_log, order->sequence, order->end_offset,
+                   customer->customer_id, order->title, order->title_length,
+                   order->price, receipt.remaining_credit,
+                   approved ? WAL_APPROVED : WAL_REJECTED);
+    }
+    credit = customer->credit_limit;
+    if (!shards)
+        database_unlock_customer(customerDatabase, customer);
 
-        if (is_done && queue_isempty(queue)) {
-            // No more orders to process. Exit this thread.
-            pthread_mutex_unlock(&queue->mutex);
-            return NULL;
-        }
-        else if (queue_isempty(queue)) {
-            // The queue is empty again.
-            pthread_mutex_unlock(&queue->mutex);
-            sched_yield();
+    processed[worker][order->category_id]++;
+    if (!approved)
+        rejected[worker][order->category_id]++;
+    STATS_CATEGORY(order->category_id, !approved);
+    STATS_LATENCY(order);
+
+    if (output->mode == OUTPUT_NONE) {
+        // Nothing to print
+    }
+    else if (output->mode == OUTPUT_SUMMARY) {
+        output_printf(output, buffer,
+                      "%s|%ld|%.*s|" MONEY_FORMAT "|" MONEY_FORMAT "\n",
+                      approved ? "OK" : "REJECTED",
+                      customer->customer_id,
+                      order->title_length, order->title,
+                      MONEY_ARGS(order->price),
+                      MONEY_ARGS(credit));
+    }
+    else if (approved) {
+        output_printf(output, buffer,
+                      "Customer %s has made a successful purchase!\n"
+                      "\tBook: %.*s\n\tPrice: $" MONEY_FORMAT "\n"
+                      "\tRemaining credit: $" MONEY_FORMAT "\n\n",
+                      customer->name,
+                      order->title_length, order->title,
+                      MONEY_ARGS(order->price),
+                      MONEY_ARGS(credit));
+    }
+    else {
+        // Insufficient funds.
+        output_printf(output, buffer,
+                      "%s has insufficient funds for a purchase.\n"
+                      "\tBook: %.*s\n\tRemaining credit: $" MONEY_FORMAT
+                      "\n\n",
+                      customer->name,
+                      order->title_length, order->title,
+                      MONEY_ARGS(credit));
+    }
+    order_destroy(order);
+}
+
+
+/**
+ * Hands a worker's output buffer to the writer. The pool calls this after
+ * every slice of a customer's orders, before another worker can take the
+ * customer, so that each customer's lines are written in the order its orders
+ * were applied; a shard calls it when it runs out of orders, so that output is
+ * not held back while the order stream is quiet.
+ */
+void flush_output(int worker) {
+    output_flush(output, &buffers[worker]);
+}
+
+
+/**
+ * Logs an order that will not be applied, so that a resumed run can move past
+ * it, and destroys it.
+ */
+void skip_order(order_t *order) {
+    if (order_log) {
+        wal_append(order_log, order->sequence, order->end_offset,
+                   order->customer_id, order->title, order->title_length,
+                   order->price, 0, WAL_SKIPPED);
+    }
+    order_destroy(order);
+}
+
+
+/**
+ * Returns whether a previous run already applied the order to the customer.
+ * Customers apply their orders in sequence, so an order is done if it is no
+ * later than the last one the customer recovered.
+ */
+int order_applied(customer_t *customer, order_t *order) {
+    int applied;
+
+    if (order->sequence > recovery.last_sequence)
+        return 0;
+    database_lock_customer(customerDatabase, customer);
+    applied = order->sequence <= customer->last_sequence;
+    database_unlock_customer(customerDatabase, customer);
+    return applied;
+}
+
+
+/**
+ * Gives a parsed order the next sequence number and submits it to the worker
+ * pool, or skips it if its category was not given on the command line, its
+ * customer is not in the database, or a previous run already applied it. The
+ * category is looked up by name in the category table, unless a parser thread
+ * already did so, and from then on only its ID is used. It only decides
+ * whether the order is valid and where it is counted; any worker may apply
+ * it.
+ *
+ * Before it is submitted, the order's title is interned in the book catalog,
+ * unless a parser thread already did so, and its category is pointed at the
+ * command line's copy, so that the order no longer refers to the memory it
+ * was parsed from.
+ */
+void submit_order(order_t *order, long *sequence) {
+    customer_t *customer;
+
+    order->sequence = (*sequence)++;
+    if (order->category_id < 0)
+        order->category_id = category_table_find(categories, order->category,
+                                                 order->category_length);
+    if (order->category_id < 0) {
+        fprintf(stderr, "The category %.*s is not a valid category as "
+                "specified in the input. This order will be skipped.\n",
+                order->category_length, order->category);
+        skip_order(order);
+        return;
+    }
+
+    customer = database_retrieve_customer(customerDatabase, order->customer_id);
+    if (!customer) {
+        // Invalid customer ID
+        fprintf(stderr, "There is no customer in the database with"
+                "customer ID %ld.\n", order->customer_id);
+        skip_order(order);
+        return;
+    }
+    if (order_intern(order, customerDatabase->titles) != 0) {
+        fprintf(stderr, "The title %.*s could not be added to the catalog. "
+                "This order will be skipped.\n", order->title_length,
+                order->title);
+        skip_order(order);
+        return;
+    }
+    order->category = category_table_name(categories, order->category_id);
+    if (order_applied(customer, order)) {
+        skip_order(order);
+        return;
+    }
+    if (shards)
+        shards_submit(shards, order);
+    else
+        pool_submit(pool, customer, order);
+}
+
+
+/**
+ * Code for the producer thread when the order file is read as a stream. Each
+ * line is parsed into an order pointing into the stream's buffer, which stays
+ * valid until the next line is read; submitting the order interns its title,
+ * so nothing has to be copied. Reading starts after the last order recovered
+ * from the write-ahead log, if any. The thread exits at the end of the stream,
+ * or as soon as the stream is stopped.
+ */
+void *producer_thread(void *args) {
+    char *line;
+    long sequence = recovery.sequence;
+    order_t *order;
+    size_t length;
+
+    STATS_THREAD("producer", -1);
+    if (stream_seek(order_stream, recovery.offset) != 0)
+        return NULL;
+    while ((line = stream_next_line(order_stream, &length)) != NULL) {
+        STATS_TIMED(STAT_PARSE_NS,
+                    order = order_parse_line(line, line + length));
+        if (order == NULL)
             continue;
-        }
+        STATS_ADD(STAT_ORDERS_PARSED, 1);
+        order->end_offset = order_stream->offset;
+        submit_order(order, &sequence);
+    }
+    return NULL;
+}
 
-        order = (order_t *) queue_peek(queue);
-        if (strcmp(order->category, category) != 0) {
-            // This book is not in our category.
-            pthread_mutex_unlock(&queue->mutex);
-            sched_yield();
-        }
-        else {
-            // Process the order.
-            order = (order_t *) queue_dequeue(queue);
-            customer = database_retrieve_customer(customerDatabase,
-                                                  order->customer_id);
-            if (!customer) {
-                // Invalid customer ID
-                fprintf(stderr, "There is no customer in the database with"
-                        "customer ID %d.\n", order->customer_id);
-            }
-            else {
-                receipt = receipt_create(order->title,
-                                         order->price,
-                                         customer->credit_limit - order->price);
-                if (customer->credit_limit < order->price) {
-                    // Insufficient funds.
-                    printf("%s has insufficient funds for a purchase.\n"
-                           "\tBook: %s\n\tRemaining credit: $%.2f\n\n",
-                           customer->name,
-                           order->title,
-                           customer->credit_limit);
-                    queue_enqueue(customer->failed_orders, receipt);
-                }
-                else {
-                    // Subtract price from remaining credit
-                    customer->credit_limit -= order->price;
-                    printf("Customer %s has made a successful purchase!\n"
-                           "\tBook: %s\n\tPrice: $%.2f\n"
-                           "\tRemaining credit: $%.2f\n\n",
-                           customer->name,
-                           order->title,
-                           order->price,
-                           customer->credit_limit);
-                    queue_enqueue(customer->successful_orders, receipt);
-                }
-            }
-            order_destroy(order);
-            pthread_mutex_unlock(&queue->mutex);
+
+/**
+ * Code for the producer thread when the order file is memory mapped. The
+ * argument is the mapped order_file_t. Lines are scanned in place a batch at
+ * a time, and the orders point into the mapping rather than holding copies of
+ * their strings.
+ */
+void *mapped_producer_thread(void *args) {
+    order_file_t *file = (order_file_t *) args;
+    order_t *orders[SCANBATCH];
+    long sequence = recovery.sequence;
+    size_t count, i, position = recovery.offset;
+
+    STATS_THREAD("producer", -1);
+    while (position < file->length) {
+        STATS_TIMED(STAT_PARSE_NS,
+                    count = order_file_parse(file, &position, file->length,
+                                             orders));
+        STATS_ADD(STAT_ORDERS_PARSED, count);
+        for (i = 0; i < count; i++) {
+            submit_order(orders[i], &sequence);
         }
     }
 
-    free(category);
     return NULL;
 }
 
 
 /**
- * Code for the producer threads. They open an input file and place orders into
- * the queue for processing.
+ * Code for the producer thread when the order file is parsed by several parser
+ * threads at once. The argument is the mapped order_file_t. The file is split
+ * into one chunk per parser at line boundaries; this thread then merges the
+ * chunks back together in file order, numbering and submitting each order, so
+ * every customer sees exactly the same sequence as with a single producer.
  */
-void *producer_thread(void *args) {
-    FILE *file;
-    char *category, *lineptr, *title;
-    const char *delims = "|\r\n";
-    float price;
-    int customer_id;
-    order_t *order;
-    size_t len;
-    ssize_t read;
-
-    // Open the text file containing orders
-    len = 0;
-    lineptr = NULL;
-    file = fopen((char *) args, "r");
-    if (file == NULL) {
-        fprintf(stderr, "An error occurred while opening the file.\n");
+void *parallel_producer_thread(void *args) {
+    order_file_t *file = (order_file_t *) args;
+    order_chunk_t *chunks;
+    order_t *orders[CHUNKBATCH];
+    long sequence = recovery.sequence;
+    size_t count, i;
+    int c;
+    pthread_t tid[num_producers];
+
+    STATS_THREAD("producer", -1);
+    if ((chunks = order_file_split(file, num_producers, recovery.offset)) == NULL) {
+        fprintf(stderr, "Error: could not split the order file.\n");
         exit(EXIT_FAILURE);
     }
+    for (c = 0; c < num_producers; c++) {
+        chunks[c].titles = customerDatabase->titles;
+        chunks[c].categories = categories;
+        pthread_create(&tid[c], NULL, order_chunk_parse, &chunks[c]);
+    }
+
+    for (c = 0; c < num_producers; c++) {
+        while ((count = queue_dequeue_batch(chunks[c].orders, (void **) orders,
+                                            CHUNKBATCH)) > 0) {
+            for (i = 0; i < count; i++) {
+                submit_order(orders[i], &sequence);
+            }
+        }
+        pthread_join(tid[c], NULL);
+    }
+
+    order_chunks_destroy(chunks, num_producers);
+    return NULL;
+}
 
-    // Begin parsing the order text file line by line
-    while ((read = getline(&lineptr, &len, file)) != -1) {
-        // Parse this line, getting relevant information
-        title = strtok(lineptr, delims);
-        price = atof(strtok(NULL, delims));
-        customer_id = atoi(strtok(NULL, delims));
-        category = strtok(NULL, delims);
 
-        if (strstr(input_categories, category) == NULL) {
-            fprintf(stderr, "The category %s is not a valid category as "
-                    "specified in the input. This order will be skipped.\n",
-                    category);
+/**
+ * Writes an incremental report through the output writer: the balance of every
+ * customer whose balance changed since the last report, then the revenue so
+ * far. Each customer is locked only while its balance is read, so the workers
+ * keep running. Customers of a snapshot that were never loaded cannot have
+ * changed, so they are skipped without loading them.
+ */
+void write_report(long number) {
+    output_buffer_t *buffer = NULL;
+    customer_t *customer;
+    money_t credit, revenue, spent;
+    int changed;
+    size_t c;
+
+    output_printf(output, &buffer, "=== Incremental Report %ld ===\n", number);
+    revenue = 0;
+    for (c = 0; c < customerDatabase->num_customers; c++) {
+        if (!atomic_load(&customerDatabase->customers[c].loaded))
             continue;
+        customer = database_customer(customerDatabase, c);
+        database_lock_customer(customerDatabase, customer);
+        credit = customer->credit_limit;
+        spent = customer->spent;
+        changed = customer->changed;
+        customer->changed = 0;
+        database_unlock_customer(customerDatabase, customer);
+
+        revenue += spent;
+        if (changed) {
+            output_printf(output, &buffer, "%ld|%s|" MONEY_FORMAT "\n",
+                          customer->customer_id, customer->name,
+                          MONEY_ARGS(credit));
         }
+    }
+    output_printf(output, &buffer, "Total Revenue: $" MONEY_FORMAT "\n"
+                  "=== End Incremental Report %ld ===\n\n", MONEY_ARGS(revenue),
+                  number);
+    output_flush(output, &buffer);
+}
 
-        // Enqueue this order in a thread-safe manner
-        order = order_create(title, price, customer_id, category);
-        pthread_mutex_lock(&queue->mutex);
-        queue_enqueue(queue, (void *) order);
-        pthread_mutex_unlock(&queue->mutex);
 
-        // Alert the consumers
-        pthread_cond_signal(&queue->nonempty);
-    }
+/**
+ * Code for the reporter thread, which handles the signals for the whole
+ * program; every other thread has them blocked. SIGUSR1 asks for an incremental
+ * report, and so does every report interval. SIGTERM and SIGINT stop the order
+ * stream: the orders already submitted are drained and the program then exits
+ * as it would at the end of the order file.
+ */
+void *reporter_thread(void *args) {
+    sigset_t *signals = (sigset_t *) args;
+    struct timespec timeout;
+    long number = 0;
+    int signal;
 
-    // Finally, tell the consumers that we're done producing orders.
-    is_done = 1;
-    pthread_cond_broadcast(&queue->nonempty);
-    free(lineptr);
-    fclose(file);
+    timeout.tv_sec = (time_t) report_interval;
+    timeout.tv_nsec = (long) ((report_interval - timeout.tv_sec) * 1e9);
+    STATS_THREAD("reporter", -1);
+    for (;;) {
+        if (report_interval > 0)
+            signal = sigtimedwait(signals, NULL, &timeout);
+        else if (sigwait(signals, &signal) != 0)
+            signal = -1;
+        if (atomic_load(&reporter_done))
+            break;
+        if (signal == SIGUSR1)
+            STATS_DUMP(stderr, "signal");
+
+        if (signal == SIGTERM || signal == SIGINT) {
+            if (order_stream)
+                stream_stop(order_stream);
+        }
+        else if (shards && signal == SIGUSR1) {
+            fprintf(stderr, "Incremental reports are not available with "
+                    "shards.\n");
+        }
+        else if (signal == SIGUSR1 || (signal < 0 && errno == EAGAIN)) {
+            write_report(++number);
+        }
+    }
     return NULL;
 }
 
 
 /**
- * Sets up the customer database
+ * Prints what applying the orders cost the whole process, between the two
+ * resource usage samples, per applied order: CPU time and voluntary and
+ * involuntary context switches. Threads that spin waiting for work show up as
+ * CPU time; threads that are woken for nothing show up as switches.
+ */
+void print_measurement(struct rusage *before, struct rusage *after,
+                       double seconds, long orders) {
+    double user, system;
+    long voluntary, involuntary;
+
+    user = (after->ru_utime.tv_sec - before->ru_utime.tv_sec)
+           + (after->ru_utime.tv_usec - before->ru_utime.tv_usec) / 1e6;
+    system = (after->ru_stime.tv_sec - before->ru_stime.tv_sec)
+             + (after->ru_stime.tv_usec - before->ru_stime.tv_usec) / 1e6;
+    voluntary = after->ru_nvcsw - before->ru_nvcsw;
+    involuntary = after->ru_nivcsw - before->ru_nivcsw;
+    if (orders < 1)
+        orders = 1;
+
+    fprintf(stderr, "Measure: %ld orders in %.3f s, %.3f s user and %.3f s "
+            "system CPU\n", orders, seconds, user, system);
+    fprintf(stderr, "Measure: %.3f us CPU per order, %.3f voluntary and "
+            "%.3f involuntary context switches per thousand orders\n",
+            (user + system) * 1e6 / orders, voluntary * 1e3 / orders,
+            involuntary * 1e3 / orders);
+}
+
+
+/**
+ * Sets up the customer database, either by mapping a snapshot written by
+ * dbsnapshot or by parsing the text database.
  */
 database_t *setup_database(char *filepath) {
-    FILE *database;
-    char *entry, *lineptr, *name;
-    float credit_limit;
-    int customer_id;
-    size_t len;
-    ssize_t read;
-    database_t *returnDatabase = database_create();
-    customer_t *newCustomer = NULL;
+    database_t *returnDatabase;
 
     //make sure filepath is referencing a valid file
     if (is_file(filepath) == 0) {
@@ -218,30 +630,17 @@ database_t *setup_database(char *filepath) {
         exit(EXIT_FAILURE);
     }
 
-    database = fopen(filepath, "r");
-
-    lineptr = NULL;
-    len = 0;
-
-    while ((read = getline(&lineptr, &len, database)) != -1) {
-        newCustomer = NULL;
-        if((entry = strtok(lineptr, "|")) != NULL) {
-            name = (char *) malloc(strlen(entry) + 1);
-            strcpy(name, entry);
-        }
-        if ((entry = strtok(NULL, "|")) != NULL) {
-            customer_id = atoi(entry);
-        }
-        if ((entry = strtok(NULL, "|")) != NULL) {
-            credit_limit = atof(entry);
+    if (snapshot_check(filepath)) {
+        if ((returnDatabase = snapshot_open(filepath)) == NULL) {
+            fprintf(stderr, "Error: %s is not a snapshot this build can read; "
+                    "rebuild it with dbsnapshot\n", filepath);
+            exit(EXIT_FAILURE);
         }
-
-        newCustomer = customer_create(name, customer_id, credit_limit);
-        database_add_customer(returnDatabase, newCustomer);
-
     }
-    free(lineptr);
-    fclose(database);
+    else if ((returnDatabase = database_load(filepath)) == NULL) {
+        fprintf(stderr, "Error: could not load the database\n");
+        exit(EXIT_FAILURE);
+    }
     return returnDatabase;
 }
 
@@ -250,110 +649,435 @@ database_t *setup_database(char *filepath) {
  * Runs the program.
  */
 int main(int argc, char **argv) {
-    char *category, **all_categories;
+    char *category;
     customer_t *customer;
-    float revenue;
-    int i, num_categories;
-    receipt_t *receipt;
+    money_t revenue;
+    int follow, i, listed, measure, r, num_shards, num_workers, opt;
+    int output_mode, use_mmap, verbose, w;
+    long category_processed, category_rejected, max_inflight, max_bytes;
+    long checkpoint_every, wal_sync, wal_sync_ms, total_processed;
+    char *wal_path;
+    pthread_t producer, reporter;
+    sigset_t signals;
+    size_t c, capacity;
+    order_file_t *order_file;
+    node_pool_stats_t pool_stats;
+    receipt_log_t *receipts;
     void *ignore;
+    struct timespec start, end, started, finished;
+    struct rusage usage_before, usage_after;
+    size_t num_customers;
+    static struct option long_options[] = {
+        {"max-inflight", required_argument, NULL, 'q'},
+        {"max-inflight-bytes", required_argument, NULL, 'b'},
+        {"wal", required_argument, NULL, 'L'},
+        {"wal-sync", required_argument, NULL, 'S'},
+        {"wal-sync-ms", required_argument, NULL, 'T'},
+        {"checkpoint", required_argument, NULL, 'C'},
+        {"measure", no_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Parse the options
+    use_mmap = 0;
+    follow = 0;
+    report_interval = 0;
+    verbose = 0;
+    measure = 0;
+    num_producers = 1;
+    num_shards = 0;
+    num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    output_mode = OUTPUT_FULL;
+    max_inflight = DEFAULT_MAX_INFLIGHT;
+    max_bytes = 0;
+    wal_path = NULL;
+    wal_sync = DEFAULT_WAL_SYNC;
+    wal_sync_ms = DEFAULT_WAL_SYNC_MS;
+    checkpoint_every = DEFAULT_CHECKPOINT;
+    while ((opt = getopt_long(argc, argv, "fi:mj:o:s:vw:", long_options,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            follow = 1;
+            break;
+        case 'i':
+            if ((report_interval = atof(optarg)) <= 0) {
+                fprintf(stderr, "Error: invalid report interval %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            use_mmap = 1;
+            break;
+        case 'j':
+            num_producers = atoi(optarg);
+            if (num_producers < 1) {
+                fprintf(stderr, "Error: -j needs at least one producer\n");
+                exit(EXIT_FAILURE);
+            }
+            use_mmap |= num_producers > 1;
+            break;
+        case 'o':
+            if ((output_mode = output_mode_parse(optarg)) < 0) {
+                fprintf(stderr, "Error: unknown output mode %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            if ((num_shards = atoi(optarg)) < 1) {
+                fprintf(stderr, "Error: -s needs at least one shard\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'U':
+            measure = 1;
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            break;
+        case 'q':
+            if ((max_inflight = parse_size(optarg)) < 0) {
+                fprintf(stderr, "Error: invalid order limit %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            if ((max_bytes = parse_size(optarg)) < 0) {
+                fprintf(stderr, "Error: invalid byte limit %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            wal_path = optarg;
+            break;
+        case 'S':
+            if ((wal_sync = parse_count(optarg)) < 0) {
+                fprintf(stderr, "Error: invalid sync count %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            if ((wal_sync_ms = parse_count(optarg)) <= 0) {
+                fprintf(stderr, "Error: invalid sync interval %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            if ((checkpoint_every = parse_size(optarg)) < 0) {
+                fprintf(stderr, "Error: invalid checkpoint interval %s\n",
+                        optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind;
+    argv += optind - 1;
+
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+    if (num_shards > 0) {
+        num_workers = num_shards;
+    }
 
     // Check for the proper amount of arguments
-    if (argc != 4) {
+    if (argc != 3) {
         fprintf(stderr, "Error: wrong number of arguments\n");
         print_usage();
         exit(EXIT_FAILURE);
     }
+    if (use_mmap && (follow || strcmp(argv[2], "-") == 0)) {
+        fprintf(stderr, "Error: -m and -j need a regular order file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_shards > 0 && (report_interval > 0 || wal_path)) {
+        fprintf(stderr, "Error: -s cannot be used with -i or --wal\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_shards > 0 && max_bytes > 0) {
+        // The shards' queues bound orders, not bytes
+        fprintf(stderr, "Error: -s cannot be used with --max-inflight-bytes\n");
+        exit(EXIT_FAILURE);
+    }
 
     // Figure out how many categories there are
-    input_categories = malloc(strlen(argv[3]) + 1);
-    strcpy(input_categories, argv[3]);
-    all_categories = (char **) calloc(1024, sizeof(char *));
-    num_categories = 0;
+    if ((categories = category_table_create()) == NULL) {
+        fprintf(stderr, "Error: could not allocate the category table.\n");
+        exit(EXIT_FAILURE);
+    }
     category = strtok(argv[3], " ");
     if (category == NULL) {
         fprintf(stderr, "Error: Must specify at least one category.\n");
         exit(EXIT_FAILURE);
     }
-    all_categories[0] = malloc(strlen(category) + 1);
-    strcpy(all_categories[0], category);
-    num_categories++;
+    do {
+        if (category_table_add(categories, category, strlen(category)) < 0) {
+            fprintf(stderr, "Error: could not add category %s.\n", category);
+            exit(EXIT_FAILURE);
+        }
+    } while ((category = strtok(NULL, " ")) != NULL);
+    num_categories = categories->count;
+    STATS_INIT(categories->names, num_categories);
+    STATS_THREAD("main", -1);
 
-    while ((category = strtok(NULL, " ")) != NULL) {
-        all_categories[num_categories] = malloc(strlen(category) + 1);
-        strcpy(all_categories[num_categories], category);
-        num_categories++;
+    // Block the signals the reporter thread handles before any other thread
+    // starts, so that every thread inherits the mask. A mapped order file
+    // cannot be stopped early, so SIGTERM and SIGINT keep their usual meaning
+    // then.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (!use_mmap) {
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
     }
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-    // Holds all the thread ids spawned later
-    pthread_t tid[num_categories + 1];
-
-    // Set up customer database from file and our queue
+    // Set up customer database from file, the output writer and the per-worker
+    // state, then start the worker pool
+    clock_gettime(CLOCK_MONOTONIC, &start);
     customerDatabase = setup_database(argv[1]);
-    queue = queue_create();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    num_customers = customerDatabase->num_customers;
+    output = output_create(STDOUT_FILENO, output_mode);
+    if (output == NULL) {
+        fprintf(stderr, "Error: could not start the output writer\n");
+        exit(EXIT_FAILURE);
+    }
+    buffers = (output_buffer_t **) calloc(num_workers,
+                                          sizeof(output_buffer_t *));
+    processed = (long **) malloc(num_workers * sizeof(long *));
+    rejected = (long **) malloc(num_workers * sizeof(long *));
+    for (w = 0; w < num_workers; w++) {
+        processed[w] = (long *) calloc(num_categories, sizeof(long));
+        rejected[w] = (long *) calloc(num_categories, sizeof(long));
+    }
 
-    // Spawn producer thread
-    pthread_create(&tid[0], NULL, producer_thread, (void *) argv[2]);
+    // Restore the balances from the write-ahead log before any order is read,
+    // and find where to resume the order file
+    if (wal_path) {
+        if (wal_recover(wal_path, customerDatabase, &recovery) != 0) {
+            fprintf(stderr, "Error: could not recover from the log %s\n",
+                    wal_path);
+            exit(EXIT_FAILURE);
+        }
+        order_log = wal_open(wal_path, customerDatabase, &recovery, wal_sync,
+                             wal_sync_ms, checkpoint_every);
+        if (order_log == NULL) {
+            fprintf(stderr, "Error: could not open the log %s\n", wal_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        recovery.last_sequence = -1;
+    }
 
-    // Spawn all the consumer threads
-    for (i = 0; i < num_categories; i++) {
-        pthread_create(&tid[i + 1], NULL, consumer_thread, all_categories[i]);
+    if (num_shards > 0) {
+        // Split the order limit between the shards; a share of zero would
+        // leave the queues unbounded
+        capacity = (size_t) max_inflight / num_shards;
+        if (max_inflight > 0 && capacity == 0)
+            capacity = 1;
+        shards = shards_create(num_shards, process_order, flush_output,
+                               capacity);
+        if (shards == NULL) {
+            fprintf(stderr, "Error: could not start the shards\n");
+            exit(EXIT_FAILURE);
+        }
     }
+    else {
+        pool = pool_create(customerDatabase, num_workers, process_order,
+                           flush_output, max_inflight, (size_t) max_bytes);
+        if (pool == NULL) {
+            fprintf(stderr, "Error: could not start the worker pool\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The measurement covers reading and applying the orders
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    getrusage(RUSAGE_SELF, &usage_before);
 
-    // Wait for all the other threads to finish before continuing
-    for (i = 0; i < num_categories + 1; i++) {
-        pthread_join(tid[i], &ignore);
+    // Spawn producer thread. A mapped order file stays mapped until the final
+    // report is done, since the orders point into it.
+    order_file = NULL;
+    if (use_mmap) {
+        if ((order_file = order_file_open(argv[2])) == NULL) {
+            fprintf(stderr, "An error occurred while opening the file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&producer, NULL, num_producers > 1
+                                        ? parallel_producer_thread
+                                        : mapped_producer_thread, order_file);
+    }
+    else {
+        if ((order_stream = stream_open(argv[2], follow)) == NULL) {
+            fprintf(stderr, "An error occurred while opening the file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&producer, NULL, producer_thread, NULL);
     }
+    atomic_init(&reporter_done, 0);
+    pthread_create(&reporter, NULL, reporter_thread, &signals);
 
-    // Now we can print our final report
+    // Wait for the producer, then for the workers to apply every order
+    pthread_join(producer, &ignore);
+    if (shards)
+        shards_finish(shards);
+    else
+        pool_finish(pool);
+    wal_close(order_log);
+    getrusage(RUSAGE_SELF, &usage_after);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    // Stop the reporter; it checks the flag before acting on the signal
+    atomic_store(&reporter_done, 1);
+    pthread_kill(reporter, SIGUSR1);
+    pthread_join(reporter, &ignore);
+    stream_close(order_stream);
+
+    // Let the writer finish before the final report goes to standard output
+    for (w = 0; w < num_workers; w++) {
+        output_flush(output, &buffers[w]);
+    }
+    output_destroy(output);
+
+    // Now we can print our final report. After a resume, only the receipts
+    // logged since the checkpoint are listed; the revenue from before it comes
+    // from the checkpoint.
     printf("\n\n");
-    revenue = 0.0f;
-    for (i = 0; i < MAXCUSTOMERS; i++) {
-        customer = customerDatabase->customer[i];
-        if (customer == NULL) {
-            continue;
-        }
+    revenue = recovery.revenue;
+    for (c = 0; c < customerDatabase->num_customers; c++) {
+        customer = database_customer(customerDatabase, c);
+        receipts = &customer->receipts;
+        revenue += receipt_log_revenue(receipts);
 
         // Print out this customer's data
         printf("=== Customer Info ===\n");
         printf("--- Balance ---\n");
         printf("Customer name: %s\n", customer->name);
-        printf("Customer ID number: %d\n", customer->customer_id);
-        printf("Remaining credit: %.2f\n", customer->credit_limit);
+        printf("Customer ID number: %ld\n", customer->customer_id);
+        printf("Remaining credit: " MONEY_FORMAT "\n",
+               MONEY_ARGS(customer->credit_limit));
 
         // Successful book orders
         printf("\n--- Successful orders ---\n");
-        if (queue_isempty(customer->successful_orders)) {
-                printf("\tNone.\n");
-        }
-        else {
-            while ((receipt = (receipt_t *)
-                        queue_dequeue(customer->successful_orders)) != NULL) {
-                printf("%s|%.2f|%.2f\n", receipt->title, receipt->price,
-                                           receipt->remaining_credit);
-                revenue += receipt->price;
-                receipt_destroy(receipt);
+        listed = 0;
+        for (r = 0; r < receipts->count; r++) {
+            if (receipts->successful[r]) {
+                printf("%s|" MONEY_FORMAT "|" MONEY_FORMAT "\n",
+                       catalog_title(customerDatabase->titles,
+                                     receipts->title_ids[r]),
+                       MONEY_ARGS(receipts->prices[r]),
+                       MONEY_ARGS(receipts->credits[r]));
+                listed++;
             }
         }
+        if (listed == 0) {
+            printf("\tNone.\n");
+        }
 
         // Failed book orders
         printf("\n--- Failed orders ---\n");
-        if (queue_isempty(customer->failed_orders)) {
+        listed = 0;
+        for (r = 0; r < receipts->count; r++) {
+            if (!receipts->successful[r]) {
+                printf("%s|" MONEY_FORMAT "\n",
+                       catalog_title(customerDatabase->titles,
+                                     receipts->title_ids[r]),
+                       MONEY_ARGS(receipts->prices[r]));
+                listed++;
+            }
+        }
+        if (listed == 0) {
             printf("None.\n");
         }
-        else {
-            while ((receipt = (receipt_t *)
-                        queue_dequeue(customer->failed_orders)) != NULL) {
-                printf("%s|%.2f\n", receipt->title, receipt->price);
-                receipt_destroy(receipt);
+        printf("=== End Customer Info ===\n\n");
+    }
+
+    printf("Total Revenue: $" MONEY_FORMAT "\n", MONEY_ARGS(revenue));
+
+    order_file_close(order_file);
+
+    if (measure) {
+        total_processed = 0;
+        for (w = 0; w < num_workers; w++) {
+            for (i = 0; i < num_categories; i++) {
+                total_processed += processed[w][i];
+            }
+        }
+        print_measurement(&usage_before, &usage_after,
+                          (finished.tv_sec - started.tv_sec)
+                          + (finished.tv_nsec - started.tv_nsec) / 1e9,
+                          total_processed);
+    }
+    if (verbose) {
+        for (i = 0; i < num_categories; i++) {
+            category_processed = category_rejected = 0;
+            for (w = 0; w < num_workers; w++) {
+                category_processed += processed[w][i];
+                category_rejected += rejected[w][i];
             }
+            fprintf(stderr, "Category %s: %ld processed, %ld rejected\n",
+                    category_table_name(categories, i), category_processed,
+                    category_rejected);
         }
-        printf("=== End Customer Info ===\n\n");
+        for (w = 0; w < num_workers; w++) {
+            if (shards) {
+                fprintf(stderr, "Shard %d: %ld orders\n", w,
+                        shards->shards[w].applied);
+            }
+            else {
+                fprintf(stderr, "Worker %d: %lu steals\n", w,
+                        pool->workers[w].steals);
+            }
+        }
+        fprintf(stderr, "Database: %zu customers set up in %.3f ms\n",
+                num_customers, (end.tv_sec - start.tv_sec) * 1e3
+                               + (end.tv_nsec - start.tv_nsec) / 1e6);
+        fprintf(stderr, "Scanner: %s\n", scan_implementation());
+        fprintf(stderr, "Catalog: %u titles in %zu bytes\n",
+                catalog_size(customerDatabase->titles),
+                atomic_load(&customerDatabase->titles->bytes));
+        if (pool) {
+            fprintf(stderr, "In flight: peak %ld orders, %zu bytes\n",
+                    pool->peak_inflight, pool->peak_inflight_bytes);
+            fprintf(stderr, "Producer: blocked %ld times for %.3f seconds\n",
+                    pool->blocked_count, pool->blocked_seconds);
+        }
+        if (order_log) {
+            fprintf(stderr, "Log: %ld orders recovered, %ld logged in %ld "
+                    "groups with %ld syncs, %ld checkpoints\n",
+                    recovery.replayed, order_log->records, order_log->groups,
+                    order_log->syncs, order_log->checkpoints);
+        }
+        node_pool_stats(&pool_stats);
+        fprintf(stderr, "Node pool: %lu hits, %lu misses, %lu slabs\n",
+                pool_stats.hits, pool_stats.misses, pool_stats.slabs);
     }
 
-    printf("Total Revenue: $%.2f\n", revenue);
+    STATS_DUMP(stderr, "exit");
 
     // Free all the memory we allocated
     database_destroy(customerDatabase);
-    queue_destroy(queue, NULL);
+    category_table_destroy(categories);
+    for (w = 0; w < num_workers; w++) {
+        free(processed[w]);
+        free(rejected[w]);
+    }
+    free(processed);
+    free(rejected);
+    free(buffers);
+    pool_destroy(pool);
+    shards_destroy(shards);
+    wal_destroy(order_log);
+    node_pool_destroy();
+    STATS_DESTROY();
     return EXIT_SUCCESS;
 }
@@ -1,128 +1,509 @@
 #include "books.h"
 #include "queue.h"
 #include "node.h"
+#include "scan.h"
+#include "snapshot.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+/**
+ * The most database lines split into fields in one pass.
+ */
+#define DATABASE_SCAN 64
 
 /**
  * Creates a new book order structure.
  */
-order_t *order_create(char *title, float price, int cust_id, char *category) {
+order_t *order_create(char *title, money_t price, long cust_id,
+                      char *category) {
+    order_t *order = order_create_view(title, strlen(title), price, cust_id,
+                                       category, strlen(category));
+    if (order && order_own(order) != 0) {
+        order_destroy(order);
+        return NULL;
+    }
+    return order;
+}
+
+/**
+ * Creates a new book order structure that points at the given title and
+ * category instead of copying them.
+ */
+order_t *order_create_view(const char *title, int title_length, money_t price,
+                           long cust_id, const char *category,
+                           int category_length) {
     order_t *order = (order_t *) malloc(sizeof(order_t));
     if (order) {
+        order->next = NULL;
+        order->sequence = 0;
+        order->end_offset = 0;
+        order->title_id = 0;
+        order->category_id = -1;
         order->customer_id = cust_id;
         order->price = price;
-        order->title = (char *) malloc(strlen(title) + 1);
-        order->category = (char *) malloc(strlen(category) + 1);
-        strcpy(order->title, title);
-        strcpy(order->category, category);
+        order->title = title;
+        order->title_length = title_length;
+        order->category = category;
+        order->category_length = category_length;
+        order->buffer = NULL;
+        STATS_STAMP_NEW(order);
     }
     return order;
 }
 
+/**
+ * Copies the order's title and category into a single buffer owned by the
+ * order.
+ */
+int order_own(order_t *order) {
+    char *buffer;
+    if (order->buffer)
+        return 0;
+    buffer = (char *) malloc(order->title_length + order->category_length);
+    if (!buffer)
+        return -1;
+    memcpy(buffer, order->title, order->title_length);
+    memcpy(buffer + order->title_length, order->category,
+           order->category_length);
+    order->buffer = buffer;
+    order->title = buffer;
+    order->category = buffer + order->title_length;
+    return 0;
+}
+
+/**
+ * Interns the order's title. A title copied into the order's own buffer stays
+ * there, but the order refers to the catalog's copy from now on.
+ */
+int order_intern(order_t *order, catalog_t *catalog) {
+    if (order->title_id)
+        return 0;
+    order->title_id = catalog_intern(catalog, order->title,
+                                     order->title_length);
+    if (!order->title_id)
+        return -1;
+    order->title = catalog_title(catalog, order->title_id);
+    return 0;
+}
+
 /**
  * Destroys a book order structure, freeing all associated memory.
  */
 void order_destroy(order_t *order) {
     if (order) {
-        free(order->title);
-        free(order->category);
+        free(order->buffer);
         free(order);
     }
 }
 
 /**
- * Creates a new order receipt. Returns a pointer to the new structure, or NULL
- * if allocation fails.
+ * Returns the number of heap bytes held by the order. Orders parsed in place
+ * only own their structure; the title and category belong to the mapped file.
+ */
+size_t order_size(const order_t *order) {
+    size_t size = sizeof(order_t);
+    if (order->buffer)
+        size += order->title_length + order->category_length;
+    return size;
+}
+
+/**
+ * Grows every column of the receipt log to the given capacity. A column that
+ * was grown before a later one failed just keeps its extra room.
  */
-receipt_t *receipt_create(char *title, float price, float remaining_credit) {
-    receipt_t *receipt = (receipt_t *) malloc(sizeof(receipt_t));
-    if (receipt) {
-        receipt->price = price;
-        receipt->remaining_credit = remaining_credit;
-        receipt->title = (char *) malloc(strlen(title) + 1);
-        strcpy(receipt->title, title);
+static int receipt_log_grow(receipt_log_t *log, int capacity) {
+    void *column;
+
+    if ((column = realloc(log->prices, capacity * sizeof(money_t))) == NULL)
+        return -1;
+    log->prices = (money_t *) column;
+    if ((column = realloc(log->credits, capacity * sizeof(money_t))) == NULL)
+        return -1;
+    log->credits = (money_t *) column;
+    if ((column = realloc(log->title_ids,
+                          capacity * sizeof(unsigned int))) == NULL)
+        return -1;
+    log->title_ids = (unsigned int *) column;
+    if ((column = realloc(log->successful, capacity)) == NULL)
+        return -1;
+    log->successful = (unsigned char *) column;
+    log->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Frees the columns of the receipt log.
+ */
+static void receipt_log_clear(receipt_log_t *log) {
+    free(log->prices);
+    free(log->credits);
+    free(log->title_ids);
+    free(log->successful);
+}
+
+/**
+ * Adds up the successful prices. Each price is masked by its status byte
+ * rather than tested, so that the loop is a plain reduction.
+ */
+money_t receipt_log_revenue(const receipt_log_t *log) {
+    const money_t *prices = log->prices;
+    const unsigned char *successful = log->successful;
+    money_t total = 0;
+    int i;
+
+    for (i = 0; i < log->count; i++) {
+        total += prices[i] & -(money_t) successful[i];
     }
-    return receipt;
+    return total;
+}
+
+/**
+ * Appends the receipt to the customer's log. The log starts with room for a
+ * few receipts on the first one and doubles whenever it fills up.
+ */
+int customer_add_receipt(customer_t *customer, receipt_t *receipt) {
+    receipt_log_t *log = &customer->receipts;
+
+    if (log->count == log->capacity
+            && receipt_log_grow(log, log->capacity ? 2 * log->capacity : 4) != 0)
+        return -1;
+    log->prices[log->count] = receipt->price;
+    log->credits[log->count] = receipt->remaining_credit;
+    log->title_ids[log->count] = receipt->title_id;
+    log->successful[log->count] = receipt->successful;
+    log->count++;
+    return 0;
 }
 
 /**
- * Destroys a receipt structure.
+ * Frees the customer's receipts, and its name unless the name belongs to a
+ * mapped snapshot.
  */
-void receipt_destroy(void *data) {
-    receipt_t *receipt;
-    if (data) {
-        receipt = (receipt_t *) data;
-        free(receipt->title);
-        free(receipt);
+static void customer_clear(database_t *database, customer_t *customer) {
+    if (!database->mapping)
+        free((char *) customer->name);
+    receipt_log_clear(&customer->receipts);
+}
+
+/**
+ * Hashes a customer ID into a table with the given capacity. Fibonacci hashing
+ * spreads sequential and sparse IDs alike over the whole table.
+ */
+static size_t database_hash(long customer_id, size_t capacity) {
+    return (size_t) ((unsigned long) customer_id * 0x9E3779B97F4A7C15UL)
+           & (capacity - 1);
+}
+
+/**
+ * Finds the slot for the given customer ID: either the slot holding it, or the
+ * empty slot where it belongs.
+ */
+static database_slot_t *database_probe(database_slot_t *slots, size_t capacity,
+                                       long customer_id) {
+    size_t i = database_hash(customer_id, capacity);
+    while (slots[i].position && slots[i].customer_id != customer_id) {
+        i = (i + 1) & (capacity - 1);
     }
+    return &slots[i];
 }
 
 /**
- * Creates a new customer for the database.
+ * Moves every customer into a new table with the given capacity.
  */
-customer_t *customer_create(char *name, int customer_id, float credit_limit) {
-    customer_t *customer = (customer_t *) malloc(sizeof(customer_t));
-    if (customer) {
-        customer->customer_id = customer_id;
-        customer->credit_limit = credit_limit;
-        customer->name = (char *) malloc(strlen(name) + 1);
-        strcpy(customer->name, name);
-        customer->successful_orders = queue_create();
-        customer->failed_orders = queue_create();
+static int database_rehash(database_t *database, size_t capacity) {
+    database_slot_t *slots, *slot;
+    size_t i;
+
+    slots = (database_slot_t *) calloc(capacity, sizeof(database_slot_t));
+    if (!slots)
+        return -1;
+    for (i = 0; i < database->num_customers; i++) {
+        slot = database_probe(slots, capacity,
+                              database->customers[i].customer_id);
+        slot->customer_id = database->customers[i].customer_id;
+        slot->position = i + 1;
     }
-    return customer;
+    free(database->slots);
+    database->slots = slots;
+    database->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Creates a new empty database. The table starts at no more than half full for
+ * the expected number of customers. Returns NULL if allocation fails.
+ */
+database_t *database_create(size_t expected) {
+    size_t capacity;
+    int i;
+    database_t *database = (database_t *) calloc(1, sizeof(database_t));
+    if (!database)
+        return NULL;
+
+    if (posix_memalign((void **) &database->locks, sizeof(database_lock_t),
+                       DATABASE_LOCKS * sizeof(database_lock_t)) != 0) {
+        free(database);
+        return NULL;
+    }
+    for (i = 0; i < DATABASE_LOCKS; i++) {
+        pthread_mutex_init(&database->locks[i].mutex, NULL);
+    }
+
+    capacity = 16;
+    while (capacity < expected * 2)
+        capacity <<= 1;
+    database->max_customers = expected > 16 ? expected : 16;
+    database->customers = (customer_t *) malloc(database->max_customers
+                                                * sizeof(customer_t));
+    database->titles = catalog_create();
+    if (!database->customers || !database->titles || database_rehash(database, capacity) != 0) {
+        database_destroy(database);
+        return NULL;
+    }
+    return database;
 }
 
 /**
- * Destroys the customer, freeing all data.
+ * Reads the whole file at the given path into a buffer with a null byte after
+ * it. Returns NULL if the file cannot be read or memory runs out.
  */
-void customer_destroy(customer_t *customer) {
-    if (customer) {
-        free(customer->name);
-        queue_destroy(customer->successful_orders, &receipt_destroy);
-        queue_destroy(customer->failed_orders, &receipt_destroy);
-        free(customer);
+static char *read_file(const char *filepath, size_t *length) {
+    FILE *file;
+    char *data, *grown;
+    size_t capacity, read;
+
+    if ((file = fopen(filepath, "r")) == NULL)
+        return NULL;
+    capacity = 65536;
+    *length = 0;
+    data = (char *) malloc(capacity + 1);
+    while (data && (read = fread(data + *length, 1, capacity - *length,
+                                 file)) > 0) {
+        *length += read;
+        if (*length == capacity) {
+            capacity *= 2;
+            if ((grown = (char *) realloc(data, capacity + 1)) == NULL) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
     }
+    if (data && ferror(file)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data)
+        data[*length] = '\0';
+    return data;
 }
 
 /**
- * Creates a new empty database.
+ * Counts the lines in the given data, so that the database can be sized up
+ * front instead of growing as customers are added.
  */
-database_t *database_create(void) {
-    return (database_t *) malloc(sizeof(database_t));
+static size_t count_lines(const char *data, size_t length) {
+    const char *p, *end = data + length;
+    size_t lines = 0;
+
+    for (p = data; (p = memchr(p, '\n', end - p)) != NULL; p++)
+        lines++;
+    return lines + 1;
+}
+
+/**
+ * Loads a database from the text file at the given path. The file is read
+ * whole and split into fields a batch of lines at a time by the scanner. The
+ * name is terminated in place, since the buffer is ours. Lines without all
+ * three leading fields are skipped.
+ */
+database_t *database_load(const char *filepath) {
+    scan_line_t lines[DATABASE_SCAN];
+    char *data, *line, *name;
+    money_t credit_limit;
+    long customer_id;
+    size_t i, length, num_lines, position;
+    database_t *database;
+
+    if ((data = read_file(filepath, &length)) == NULL)
+        return NULL;
+    if ((database = database_create(count_lines(data, length))) == NULL) {
+        free(data);
+        return NULL;
+    }
+
+    position = 0;
+    while (database && position < length) {
+        num_lines = scan_lines(data + position, length - position, lines,
+                               DATABASE_SCAN);
+        for (i = 0; i < num_lines; i++) {
+            if (lines[i].num_fields < 3)
+                continue;
+            line = data + position + lines[i].start;
+            name = line + lines[i].field[0];
+            name[lines[i].field_end[0] - lines[i].field[0]] = '\0';
+            customer_id = strtol(line + lines[i].field[1], NULL, 10);
+            credit_limit = money_parse(line + lines[i].field[2],
+                                       line + lines[i].field_end[2]);
+
+            if (!database_add_customer(database, name, customer_id,
+                                       credit_limit)) {
+                database_destroy(database);
+                database = NULL;
+                break;
+            }
+        }
+        position += lines[num_lines - 1].next;
+    }
+    free(data);
+    return database;
 }
 
 /**
  * Destroys the given database, freeing all associated memory.
  */
 void database_destroy(database_t *database) {
-    int i;
+    size_t i;
     if (database) {
-        for (i = 0; i < MAXCUSTOMERS; i++) {
-            customer_destroy(database->customer[i]);
+        for (i = 0; database->customers && i < database->num_customers; i++) {
+            if (atomic_load(&database->customers[i].loaded))
+                customer_clear(database, &database->customers[i]);
         }
+        for (i = 0; i < DATABASE_LOCKS; i++) {
+            pthread_mutex_destroy(&database->locks[i].mutex);
+        }
+        free(database->locks);
+        free(database->customers);
+        catalog_destroy(database->titles);
+        if (database->mapping)
+            munmap(database->mapping, database->mapping_length);
+        else
+            free(database->slots);
         free(database);
     }
 }
 
 /**
- * Adds a new customer to the database.
+ * Adds a new customer to the database. The table doubles once it is more than
+ * 70% full.
  */
-void database_add_customer(database_t *database, customer_t *customer) {
-    database->customer[customer->customer_id] = customer;
-}
+customer_t *database_add_customer(database_t *database, const char *name,
+                                  long customer_id, money_t credit_limit) {
+    database_slot_t *slot;
+    customer_t *customer, *customers;
+    char *copy;
 
-/**
- * Retrieves a customer from the database.
- */
-customer_t *database_retrieve_customer(database_t *database, int customer_id) {
-    if (customer_id >= 0 || customer_id < MAXCUSTOMERS) {
-        return database->customer[customer_id];
+    if (database->mapping)
+        return NULL;
+    if ((copy = strdup(name)) == NULL)
+        return NULL;
+
+    slot = database_probe(database->slots, database->capacity, customer_id);
+    if (slot->position) {
+        // Replace the customer with the same ID
+        customer = &database->customers[slot->position - 1];
+        customer_clear(database, customer);
     }
     else {
-        fprintf(stderr, "Customer id %d out of bounds of the database.\n", customer_id);
+        if (database->num_customers == database->max_customers) {
+            customers = (customer_t *) realloc(database->customers,
+                    2 * database->max_customers * sizeof(customer_t));
+            if (!customers) {
+                free(copy);
+                return NULL;
+            }
+            database->customers = customers;
+            database->max_customers *= 2;
+        }
+        customer = &database->customers[database->num_customers++];
+        slot->customer_id = customer_id;
+        slot->position = database->num_customers;
+    }
+
+    customer->name = copy;
+    customer->customer_id = customer_id;
+    customer->credit_limit = credit_limit;
+    customer->spent = 0;
+    customer->changed = 0;
+    customer->last_sequence = -1;
+    memset(&customer->receipts, 0, sizeof(receipt_log_t));
+    customer->pending = NULL;
+    customer->pending_tail = NULL;
+    customer->scheduled = 0;
+    atomic_init(&customer->loaded, 1);
+
+    if (database->num_customers * 10 > database->capacity * 7
+            && database_rehash(database, database->capacity * 2) != 0)
         return NULL;
+    return customer;
+}
+
+/**
+ * Picks the lock stripe for a customer from the high bits of its ID's hash, so
+ * that neighbouring IDs land on different stripes.
+ */
+static database_lock_t *database_lock(database_t *database, long customer_id) {
+    unsigned long hash = (unsigned long) customer_id * 0x9E3779B97F4A7C15UL;
+    return &database->locks[(hash >> 32) & (DATABASE_LOCKS - 1)];
+}
+
+/**
+ * Copies a customer out of its snapshot record. The customer's lock stripe
+ * makes sure only one thread does so; everyone else sees the loaded flag.
+ */
+static void database_load_customer(database_t *database, size_t index) {
+    customer_t *customer = &database->customers[index];
+    const snapshot_record_t *record = &database->records[index];
+    database_lock_t *lock = database_lock(database, record->customer_id);
+
+    STATS_LOCK(&lock->mutex, STATS_CUSTOMER_LOCK);
+    if (!atomic_load_explicit(&customer->loaded, memory_order_relaxed)) {
+        customer->name = database->strings + record->name_offset;
+        customer->customer_id = record->customer_id;
+        customer->credit_limit = record->credit_limit;
+        customer->last_sequence = -1;
+        atomic_store_explicit(&customer->loaded, 1, memory_order_release);
     }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/**
+ * Returns the customer at the given index, loading it first if need be.
+ */
+customer_t *database_customer(database_t *database, size_t index) {
+    customer_t *customer = &database->customers[index];
+    if (!atomic_load_explicit(&customer->loaded, memory_order_acquire))
+        database_load_customer(database, index);
+    return customer;
+}
+
+/**
+ * Retrieves a customer from the database, or NULL if there is no customer with
+ * the given ID.
+ */
+customer_t *database_retrieve_customer(database_t *database, long customer_id) {
+    size_t position = database_probe(database->slots, database->capacity,
+                                     customer_id)->position;
+    return position ? database_customer(database, position - 1) : NULL;
+}
+
+/**
+ * Locks the stripe protecting the given customer's credit limit and receipts.
+ */
+void database_lock_customer(database_t *database, customer_t *customer) {
+    STATS_LOCK(&database_lock(database, customer->customer_id)->mutex,
+               STATS_CUSTOMER_LOCK);
+}
+
+/**
+ * Unlocks the stripe protecting the given customer.
+ */
+void database_unlock_customer(database_t *database, customer_t *customer) {
+    pthread_mutex_unlock(
+            &database_lock(database, customer->customer_id)->mutex);
 }
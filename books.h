@@ -1,24 +1,68 @@
 #ifndef BOOKS_H
 #define BOOKS_H
 
-#define MAXCUSTOMERS 512
+#include <stdatomic.h>
 
+#include "catalog.h"
+#include "money.h"
 #include "queue.h"
+#include "stats.h"
 
 /**
- * A structure holding the information for book orders.
+ * A structure holding the information for book orders. The title and category
+ * are not null-terminated; they are views of the given length into either the
+ * order's own buffer or a mapped order file. The sequence number is the order's
+ * position among all orders in the order file, and the end offset is where the
+ * next line starts. The price is in cents. Once the title has been interned in
+ * the book catalog, the title ID is set and the title points into the catalog;
+ * until then the title ID is zero. Built with STATS, the order carries the
+ * times it reached each stage, for the latency histograms of stats.h.
  */
 typedef struct order {
-    char *title;
-    float price;
-    int customer_id;
-    char *category;
+    struct order *next;
+    long sequence;
+    long end_offset;
+    const char *title;
+    int title_length;
+    unsigned int title_id;
+    money_t price;
+    long customer_id;
+    const char *category;
+    int category_length;
+    int category_id;
+    char *buffer;
+#ifdef STATS
+    long stamps[NUM_STAGES];
+#endif
 } order_t;
 
 /**
- * Creates a new book order structure.
+ * Creates a new book order structure, copying the title and category.
+ */
+order_t *order_create(char *, money_t, long, char *);
+
+/**
+ * Creates a new book order structure whose title and category point at the
+ * given memory, such as a mapped order file, without copying them. The memory
+ * must outlive the order.
+ */
+order_t *order_create_view(const char *, int, money_t, long, const char *,
+                           int);
+
+/**
+ * Copies the title and category of an order created as a view into the order's
+ * own buffer, so that it no longer depends on the memory it was parsed from.
+ * Returns 0 on success, or -1 if memory allocation fails.
+ */
+int order_own(order_t *);
+
+/**
+ * Interns the order's title in the given catalog, sets the title ID and points
+ * the title at the catalog's copy, so that it no longer depends on the memory
+ * it was parsed from. Does nothing if the title is already interned. Returns 0
+ * on success, or -1 if the catalog cannot take the title.
  */
-order_t *order_create(char *, float, int, char *);
+int order_intern(order_t *, catalog_t *);
 
 /**
  * Destroys a book order structure, freeing all associated memory.
@@ -26,58 +70,147 @@ order_t *order_create(char *, float, int, char *);
 void order_destroy(order_t *);
 
 /**
- * A structure that carries data for the customer after every purchace.
- * successful orders use all three structure fields; unsuccessful book orders
- * only use the first two.
+ * Returns the number of heap bytes held by the order.
+ */
+size_t order_size(const order_t *);
+
+/**
+ * A receipt, kept for the customer after every purchase. The status bit tells
+ * successful orders, which use every field, from unsuccessful ones, which only
+ * use the title and price. The title is the ID of the title in the database's
+ * book catalog. Receipts are handed to the receipt log one at a time and
+ * stored there column by column.
  */
 typedef struct receipt {
-    char *title;
-    float price;
-    float remaining_credit;
+    unsigned int title_id;
+    money_t price;
+    money_t remaining_credit;
+    unsigned int successful : 1;
 } receipt_t;
 
 /**
- * Creates a new order receipt.
+ * A customer's receipts, in the order they were applied, stored as columns: the
+ * prices of every receipt sit next to each other, and so do the remaining
+ * credits, the title IDs and the status bytes. A total over the log only reads
+ * the columns it needs, and its loop has no branches, so the compiler can
+ * vectorize it. The columns are allocated when the first receipt arrives and
+ * double as they fill.
  */
-receipt_t *receipt_create(char *, float, float);
+typedef struct receipt_log {
+    money_t *prices;
+    money_t *credits;
+    unsigned int *title_ids;
+    unsigned char *successful;
+    int count;
+    int capacity;
+} receipt_log_t;
 
 /**
- * Destroys a receipt structure.
+ * Returns the total price of the successful receipts in the log.
  */
-void receipt_destroy(void *);
+money_t receipt_log_revenue(const receipt_log_t *);
 
 /**
- * Structure holding all customer information.
+ * Structure holding all customer information. The pending orders are waiting
+ * to be applied by the worker pool, and the customer is scheduled while it is
+ * in a worker's run queue or being worked on. The receipts of successful and
+ * failed orders alike go into one receipt log, which stays empty for customers
+ * who never order anything. The credit limit and the amount spent are in cents.
+ * The amount spent and the changed flag let a report running alongside the
+ * workers find the balances that changed since the last report.
+ * The last sequence number is that of the last order applied to the customer,
+ * or -1 if there has been none, which lets a resumed run skip orders that a
+ * previous run already applied.
+ *
+ * A customer in a database backed by a snapshot is not loaded until it is first
+ * retrieved; until then only its record in the snapshot is valid.
  */
 typedef struct customer {
-    char *name;
-    int customer_id;
-    float credit_limit;
-    queue_t *successful_orders;
-    queue_t *failed_orders;
+    const char *name;
+    long customer_id;
+    money_t credit_limit;
+    money_t spent;
+    int changed;
+    long last_sequence;
+    receipt_log_t receipts;
+    order_t *pending;
+    order_t *pending_tail;
+    int scheduled;
+    atomic_int loaded;
 } customer_t;
 
 /**
- * Creates a new customer for the database.
+ * Appends the receipt to the customer's receipt log. The caller must hold the
+ * customer's lock stripe. Returns 0 on success, or -1 if memory allocation
+ * fails.
+ */
+int customer_add_receipt(customer_t *, receipt_t *);
+
+/**
+ * A slot in the database's hash table. The customer ID is stored right next to
+ * the customer's position in the dense array, one past its index, so that
+ * probing never has to leave the table; an empty slot has position zero.
  */
-customer_t *customer_create(char *, int, float);
+typedef struct database_slot {
+    long customer_id;
+    size_t position;
+} database_slot_t;
 
 /**
- * Destroys the customer, freeing all data.
+ * The number of lock stripes protecting the customers. Must be a power of two.
  */
-void customer_destroy(customer_t *);
+#define DATABASE_LOCKS 256
 
 /**
- * A hash map containing all customers and their data.
+ * One lock stripe, padded out to its own cache line.
+ */
+typedef struct database_lock {
+    _Alignas(64) pthread_mutex_t mutex;
+} database_lock_t;
+
+/**
+ * A hash map containing all customers and their data, keyed by customer ID.
+ * It uses open addressing with linear probing over a power-of-two table. The
+ * customers themselves live in a dense array, in the order they were added, so
+ * they can be walked without scanning empty slots.
+ *
+ * Once set up, the table itself is only read. Each customer's credit limit and
+ * receipts are protected by one of the lock stripes, picked by customer ID, so
+ * consumers working on different customers rarely contend.
+ *
+ * A database opened from a snapshot probes the snapshot's hash table in place
+ * and loads each customer from its record on first use. Such a database cannot
+ * have customers added to it.
+ *
+ * The book catalog holds the titles that the customers' receipts refer to.
  */
 typedef struct database {
-    customer_t *customer[MAXCUSTOMERS];
+    database_slot_t *slots;
+    size_t capacity;
+    customer_t *customers;
+    size_t num_customers;
+    size_t max_customers;
+    database_lock_t *locks;
+    // The mapped snapshot, if the database was opened from one
+    void *mapping;
+    size_t mapping_length;
+    const struct snapshot_record *records;
+    const char *strings;
+    catalog_t *titles;
 } database_t;
 
 /**
- * Creates a new empty database.
+ * Creates a new empty database with room for about the given number of
+ * customers before it has to grow.
+ */
+database_t *database_create(size_t);
+
+/**
+ * Loads a database from the pipe-delimited text file at the given path, one
+ * customer per line: name, ID and credit limit, followed by fields that are
+ * ignored. Returns NULL if the file cannot be read or memory runs out.
  */
-database_t *database_create(void);
+database_t *database_load(const char *);
 
 /**
  * Destroys the given database, freeing all associated memory.
@@ -85,13 +218,33 @@ database_t *database_create(void);
 void database_destroy(database_t *);
 
 /**
- * Adds a new customer to the database.
+ * Adds a new customer to the database, copying the name, and replacing any
+ * customer with the same ID. Returns the customer, or NULL if memory allocation
+ * fails or the database was opened from a snapshot. Adding a customer may move
+ * the others, so customers must all be added before any are handed out.
+ */
+customer_t *database_add_customer(database_t *, const char *, long, money_t);
+
+/**
+ * Retrieves a customer from the database, or NULL if there is no customer with
+ * the given ID.
+ */
+customer_t *database_retrieve_customer(database_t *, long);
+
+/**
+ * Returns the customer at the given index in the order the customers were
+ * added.
+ */
+customer_t *database_customer(database_t *, size_t);
+
+/**
+ * Locks the stripe protecting the given customer's credit limit and receipts.
  */
-void database_add_customer(database_t *, customer_t *);
+void database_lock_customer(database_t *, customer_t *);
 
 /**
- * Retrieves a customer from the database.
+ * Unlocks the stripe protecting the given customer.
  */
-customer_t *database_retrieve_customer(database_t *, int);
+void database_unlock_customer(database_t *, customer_t *);
 
 #endif
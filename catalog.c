@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "catalog.h"
+
+/**
+ * The sizes of the chunks titles are copied into. A stripe's first chunk is
+ * small, and each new one is twice the size of the last, up to the largest.
+ */
+#define CATALOG_CHUNK_MIN 1024
+#define CATALOG_CHUNK_MAX 65536
+
+/**
+ * Hashes a title with 64-bit FNV-1a. The top bits pick the stripe and the
+ * bottom bits the slot within it.
+ */
+static uint64_t catalog_hash(const char *title, int length) {
+    uint64_t hash = 14695981039346656037UL;
+    int i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) title[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * Returns the directory entry for the given ID, allocating its block if need
+ * be. Two threads that race to allocate a block keep whichever got there
+ * first. Returns NULL if the ID is out of range or allocation fails.
+ */
+static catalog_entry_t *catalog_entry(catalog_t *catalog, unsigned int id,
+                                      int allocate) {
+    catalog_entry_t *block, *expected;
+    size_t index = id / CATALOG_BLOCK;
+
+    if (index >= CATALOG_BLOCKS)
+        return NULL;
+    block = atomic_load_explicit(&catalog->blocks[index],
+                                 memory_order_acquire);
+    if (!block && allocate) {
+        block = (catalog_entry_t *) calloc(CATALOG_BLOCK,
+                                           sizeof(catalog_entry_t));
+        if (!block)
+            return NULL;
+        expected = NULL;
+        if (!atomic_compare_exchange_strong(&catalog->blocks[index],
+                                            &expected, block)) {
+            free(block);
+            block = expected;
+        }
+    }
+    return block ? &block[id & (CATALOG_BLOCK - 1)] : NULL;
+}
+
+/**
+ * Copies a title into the stripe's storage. Called with the stripe locked.
+ */
+static const char *catalog_store(catalog_t *catalog, catalog_stripe_t *stripe,
+                                 const char *title, int length) {
+    catalog_chunk_t *chunk = stripe->chunks;
+    size_t size;
+    char *copy;
+
+    if (!chunk || chunk->used + length + 1 > chunk->size) {
+        size = chunk ? chunk->size * 2 : CATALOG_CHUNK_MIN;
+        if (size > CATALOG_CHUNK_MAX)
+            size = CATALOG_CHUNK_MAX;
+        if (size < (size_t) length + 1)
+            size = length + 1;
+        chunk = (catalog_chunk_t *) malloc(sizeof(catalog_chunk_t) + size);
+        if (!chunk)
+            return NULL;
+        chunk->next = stripe->chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        stripe->chunks = chunk;
+        atomic_fetch_add_explicit(&catalog->bytes,
+                                  sizeof(catalog_chunk_t) + size,
+                                  memory_order_relaxed);
+    }
+    copy = chunk->data + chunk->used;
+    memcpy(copy, title, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    return copy;
+}
+
+/**
+ * Moves the stripe's slots into a new table with the given capacity. Called
+ * with the stripe locked.
+ */
+static int catalog_rehash(catalog_stripe_t *stripe, size_t capacity) {
+    catalog_slot_t *slots;
+    size_t i, j;
+
+    slots = (catalog_slot_t *) calloc(capacity, sizeof(catalog_slot_t));
+    if (!slots)
+        return -1;
+    for (i = 0; i < stripe->capacity; i++) {
+        if (stripe->slots[i].id == 0)
+            continue;
+        j = stripe->slots[i].hash & (capacity - 1);
+        while (slots[j].id != 0)
+            j = (j + 1) & (capacity - 1);
+        slots[j] = stripe->slots[i];
+    }
+    free(stripe->slots);
+    stripe->slots = slots;
+    stripe->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Creates a new empty catalog.
+ */
+catalog_t *catalog_create(void) {
+    int i;
+    catalog_t *catalog = (catalog_t *) calloc(1, sizeof(catalog_t));
+    if (!catalog)
+        return NULL;
+
+    catalog->blocks = (_Atomic(catalog_entry_t *) *)
+            calloc(CATALOG_BLOCKS, sizeof(*catalog->blocks));
+    if (!catalog->blocks
+            || posix_memalign((void **) &catalog->stripes,
+                              sizeof(catalog_stripe_t),
+                              CATALOG_STRIPES * sizeof(catalog_stripe_t)) != 0) {
+        free(catalog->blocks);
+        free(catalog);
+        return NULL;
+    }
+    memset(catalog->stripes, 0, CATALOG_STRIPES * sizeof(catalog_stripe_t));
+    for (i = 0; i < CATALOG_STRIPES; i++) {
+        pthread_mutex_init(&catalog->stripes[i].mutex, NULL);
+    }
+    atomic_init(&catalog->next_id, 1);
+    atomic_init(&catalog->bytes, 0);
+    return catalog;
+}
+
+/**
+ * Destroys the catalog, its title storage and its directory.
+ */
+void catalog_destroy(catalog_t *catalog) {
+    catalog_chunk_t *chunk, *next;
+    int i;
+    if (catalog) {
+        for (i = 0; i < CATALOG_STRIPES; i++) {
+            for (chunk = catalog->stripes[i].chunks; chunk; chunk = next) {
+                next = chunk->next;
+                free(chunk);
+            }
+            free(catalog->stripes[i].slots);
+            pthread_mutex_destroy(&catalog->stripes[i].mutex);
+        }
+        for (i = 0; i < CATALOG_BLOCKS; i++) {
+            free(atomic_load(&catalog->blocks[i]));
+        }
+        free(catalog->blocks);
+        free(catalog->stripes);
+        free(catalog);
+    }
+}
+
+/**
+ * Returns the title's ID, interning it first if need be. Only the title's
+ * stripe is locked. The table is kept under 70% full.
+ */
+unsigned int catalog_intern(catalog_t *catalog, const char *title,
+                            int length) {
+    uint64_t hash = catalog_hash(title, length);
+    catalog_stripe_t *stripe = &catalog->stripes[hash >> 58
+                                                 & (CATALOG_STRIPES - 1)];
+    catalog_entry_t *entry;
+    const char *copy;
+    unsigned int id;
+    size_t i;
+
+    pthread_mutex_lock(&stripe->mutex);
+    if (stripe->capacity == 0 && catalog_rehash(stripe, 64) != 0) {
+        pthread_mutex_unlock(&stripe->mutex);
+        return 0;
+    }
+    for (i = hash & (stripe->capacity - 1); stripe->slots[i].id != 0;
+         i = (i + 1) & (stripe->capacity - 1)) {
+        if (stripe->slots[i].hash != hash)
+            continue;
+        entry = catalog_entry(catalog, stripe->slots[i].id, 0);
+        if (entry->length == length
+                && memcmp(entry->title, title, length) == 0) {
+            id = stripe->slots[i].id;
+            pthread_mutex_unlock(&stripe->mutex);
+            return id;
+        }
+    }
+
+    // A new title: fill in its directory entry before anyone can see its ID
+    id = atomic_fetch_add(&catalog->next_id, 1);
+    if ((entry = catalog_entry(catalog, id, 1)) == NULL
+            || (copy = catalog_store(catalog, stripe, title, length)) == NULL) {
+        pthread_mutex_unlock(&stripe->mutex);
+        return 0;
+    }
+    entry->title = copy;
+    entry->length = length;
+    stripe->slots[i].hash = hash;
+    stripe->slots[i].id = id;
+    stripe->count++;
+    if (stripe->count * 10 > stripe->capacity * 7)
+        catalog_rehash(stripe, stripe->capacity * 2);
+    pthread_mutex_unlock(&stripe->mutex);
+    return id;
+}
+
+/**
+ * Returns the title with the given ID.
+ */
+const char *catalog_title(catalog_t *catalog, unsigned int id) {
+    return catalog_entry(catalog, id, 0)->title;
+}
+
+/**
+ * Returns the length of the title with the given ID.
+ */
+int catalog_length(catalog_t *catalog, unsigned int id) {
+    return catalog_entry(catalog, id, 0)->length;
+}
+
+/**
+ * Returns the number of titles in the catalog.
+ */
+unsigned int catalog_size(catalog_t *catalog) {
+    return atomic_load(&catalog->next_id) - 1;
+}
@@ -0,0 +1,114 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The number of lock stripes the catalog's titles are spread over. Must be a
+ * power of two.
+ */
+#define CATALOG_STRIPES 64
+
+/**
+ * The number of titles in each block of the catalog's directory, and the most
+ * blocks there can be. Must be powers of two.
+ */
+#define CATALOG_BLOCK 4096
+#define CATALOG_BLOCKS 16384
+
+/**
+ * A title in the catalog. The title is null-terminated and never moves.
+ */
+typedef struct catalog_entry {
+    const char *title;
+    int length;
+} catalog_entry_t;
+
+/**
+ * A slot in a stripe's hash table: the title's hash next to its ID, so that
+ * probing only looks at a title when the hashes match. An empty slot has ID
+ * zero.
+ */
+typedef struct catalog_slot {
+    uint64_t hash;
+    uint32_t id;
+} catalog_slot_t;
+
+/**
+ * A block of title storage. Titles are copied one after another into the
+ * current chunk; the chunks are chained so that they can be freed.
+ */
+typedef struct catalog_chunk {
+    struct catalog_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} catalog_chunk_t;
+
+/**
+ * One lock stripe with the titles that hash to it, padded out to its own cache
+ * line.
+ */
+typedef struct catalog_stripe {
+    _Alignas(64) pthread_mutex_t mutex;
+    catalog_slot_t *slots;
+    size_t capacity;
+    size_t count;
+    catalog_chunk_t *chunks;
+} catalog_stripe_t;
+
+/**
+ * A catalog of book titles, which gives every distinct title a compact ID,
+ * starting at one, so that orders and receipts can refer to a title without
+ * copying it.
+ *
+ * Titles are interned concurrently: each hashes to one of the stripes, which
+ * has its own lock, hash table and title storage, so threads interning
+ * different titles rarely contend. Looking a title up by its ID takes no lock
+ * at all. IDs index a directory of fixed-size blocks that are allocated as
+ * they are needed and never move, and an entry is written before its ID is
+ * handed out.
+ */
+typedef struct catalog {
+    catalog_stripe_t *stripes;
+    _Atomic(catalog_entry_t *) *blocks;
+    atomic_uint next_id;
+    atomic_size_t bytes;
+} catalog_t;
+
+/**
+ * Creates a new empty catalog. Returns NULL if memory allocation fails.
+ */
+catalog_t *catalog_create(void);
+
+/**
+ * Destroys the catalog and every title in it.
+ */
+void catalog_destroy(catalog_t *);
+
+/**
+ * Returns the ID of the title of the given length, adding a copy of the title
+ * to the catalog if it is not there yet. Returns zero if memory allocation
+ * fails or the catalog is full. Safe to call from any number of threads.
+ */
+unsigned int catalog_intern(catalog_t *, const char *, int);
+
+/**
+ * Returns the null-terminated title with the given ID.
+ */
+const char *catalog_title(catalog_t *, unsigned int);
+
+/**
+ * Returns the length of the title with the given ID.
+ */
+int catalog_length(catalog_t *, unsigned int);
+
+/**
+ * Returns the number of titles in the catalog.
+ */
+unsigned int catalog_size(catalog_t *);
+
+#endif
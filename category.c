@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "category.h"
+
+/**
+ * Hashes a category name with 32-bit FNV-1a.
+ */
+static uint32_t category_hash(const char *name, size_t length) {
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Returns the slot holding the category with the given name, or the empty slot
+ * where it would go.
+ */
+static category_slot_t *category_probe(category_table_t *table,
+                                       const char *name, size_t length,
+                                       uint32_t hash) {
+    category_slot_t *slot;
+    size_t i;
+    int id;
+
+    for (i = hash & (table->num_slots - 1); ;
+         i = (i + 1) & (table->num_slots - 1)) {
+        slot = &table->slots[i];
+        if (slot->id == 0)
+            return slot;
+        id = slot->id - 1;
+        if (slot->hash == hash && (size_t) table->lengths[id] == length
+                && memcmp(table->names[id], name, length) == 0)
+            return slot;
+    }
+}
+
+/**
+ * Moves the slots into a new hash table with the given number of slots.
+ */
+static int category_rehash(category_table_t *table, size_t num_slots) {
+    category_slot_t *slots, *old = table->slots;
+    size_t i, j, old_slots = table->num_slots;
+
+    slots = (category_slot_t *) calloc(num_slots, sizeof(category_slot_t));
+    if (!slots)
+        return -1;
+    for (i = 0; i < old_slots; i++) {
+        if (old[i].id == 0)
+            continue;
+        j = old[i].hash & (num_slots - 1);
+        while (slots[j].id != 0)
+            j = (j + 1) & (num_slots - 1);
+        slots[j] = old[i];
+    }
+    free(old);
+    table->slots = slots;
+    table->num_slots = num_slots;
+    return 0;
+}
+
+/**
+ * Creates a new empty category table.
+ */
+category_table_t *category_table_create(void) {
+    category_table_t *table = (category_table_t *)
+            calloc(1, sizeof(category_table_t));
+    if (!table)
+        return NULL;
+    if (category_rehash(table, 16) != 0) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+/**
+ * Destroys the category table.
+ */
+void category_table_destroy(category_table_t *table) {
+    int i;
+    if (table) {
+        for (i = 0; i < table->count; i++) {
+            free(table->names[i]);
+        }
+        free(table->names);
+        free(table->lengths);
+        free(table->slots);
+        free(table);
+    }
+}
+
+/**
+ * Adds a category. The name and length arrays double as they fill, and the
+ * hash table doubles before it would get more than half full.
+ */
+int category_table_add(category_table_t *table, const char *name,
+                       size_t length) {
+    uint32_t hash = category_hash(name, length);
+    category_slot_t *slot = category_probe(table, name, length, hash);
+    char **names;
+    int *lengths, capacity;
+
+    if (slot->id != 0)
+        return slot->id - 1;
+
+    if ((size_t) (table->count + 1) * 2 > table->num_slots) {
+        if (category_rehash(table, table->num_slots * 2) != 0)
+            return -1;
+        slot = category_probe(table, name, length, hash);
+    }
+    if (table->count == table->capacity) {
+        capacity = table->capacity ? table->capacity * 2 : 16;
+        names = (char **) realloc(table->names, capacity * sizeof(char *));
+        if (!names)
+            return -1;
+        table->names = names;
+        lengths = (int *) realloc(table->lengths, capacity * sizeof(int));
+        if (!lengths)
+            return -1;
+        table->lengths = lengths;
+        table->capacity = capacity;
+    }
+    if ((table->names[table->count] = (char *) malloc(length + 1)) == NULL)
+        return -1;
+    memcpy(table->names[table->count], name, length);
+    table->names[table->count][length] = '\0';
+    table->lengths[table->count] = (int) length;
+    slot->hash = hash;
+    slot->id = ++table->count;
+    return table->count - 1;
+}
+
+/**
+ * Looks a category up by name.
+ */
+int category_table_find(category_table_t *table, const char *name,
+                        size_t length) {
+    return category_probe(table, name, length,
+                          category_hash(name, length))->id - 1;
+}
+
+/**
+ * Returns the name of the category with the given ID.
+ */
+const char *category_table_name(category_table_t *table, int id) {
+    return table->names[id];
+}
@@ -0,0 +1,62 @@
+#ifndef CATEGORY_H
+#define CATEGORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A slot in the category table's hash table: the name's hash next to the
+ * category's ID plus one, so that probing only compares names when the hashes
+ * match. An empty slot holds zero.
+ */
+typedef struct category_slot {
+    uint32_t hash;
+    int id;
+} category_slot_t;
+
+/**
+ * The categories given on the command line, each with a dense ID starting at
+ * zero in the order they were added. Names are looked up through a hash table
+ * with linear probing that is kept at most half full, so finding a category
+ * takes expected constant time however many categories there are. The table is
+ * filled in before any thread starts and only read afterwards, so lookups take
+ * no lock.
+ */
+typedef struct category_table {
+    char **names;
+    int *lengths;
+    int count;
+    int capacity;
+    category_slot_t *slots;
+    size_t num_slots;
+} category_table_t;
+
+/**
+ * Creates a new empty category table. Returns NULL if memory allocation fails.
+ */
+category_table_t *category_table_create(void);
+
+/**
+ * Destroys the category table and its copies of the names.
+ */
+void category_table_destroy(category_table_t *);
+
+/**
+ * Adds a copy of the category with the given name and length, and returns its
+ * ID. A category that was already added keeps its ID. Returns -1 if memory
+ * allocation fails. Must not be called while other threads look up categories.
+ */
+int category_table_add(category_table_t *, const char *, size_t);
+
+/**
+ * Returns the ID of the category with the given name and length, or -1 if it
+ * was never added.
+ */
+int category_table_find(category_table_t *, const char *, size_t);
+
+/**
+ * Returns the null-terminated name of the category with the given ID.
+ */
+const char *category_table_name(category_table_t *, int);
+
+#endif
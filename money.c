@@ -0,0 +1,33 @@
+#include "money.h"
+
+/**
+ * Parses an amount in dollars. The whole dollars and the first two decimals
+ * make up the cents; the third decimal rounds them, and the rest is ignored.
+ */
+money_t money_parse(const char *p, const char *end) {
+    money_t cents;
+    int digits, negative;
+
+    while (p < end && *p == ' ')
+        p++;
+    negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+
+    cents = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        cents = cents * 10 + (*p++ - '0');
+
+    digits = 0;
+    if (p < end && *p == '.') {
+        p++;
+        for (; digits < 2 && p < end && *p >= '0' && *p <= '9'; digits++)
+            cents = cents * 10 + (*p++ - '0');
+    }
+    for (; digits < 2; digits++)
+        cents *= 10;
+    if (p < end && *p >= '5' && *p <= '9')
+        cents++;
+
+    return negative ? -cents : cents;
+}
@@ -0,0 +1,35 @@
+#ifndef MONEY_H
+#define MONEY_H
+
+#include <inttypes.h>
+#include <stdint.h>
+
+/**
+ * An amount of money in whole cents. Prices, credit limits and revenue are all
+ * kept in cents, so adding up millions of orders is exact and a balance never
+ * drifts the way a float does.
+ */
+typedef int64_t money_t;
+
+/**
+ * The number of cents in a dollar.
+ */
+#define MONEY_SCALE 100
+
+/**
+ * A printf format and its matching arguments for an amount in dollars with two
+ * decimals, such as "-12.05". The argument is evaluated more than once.
+ */
+#define MONEY_FORMAT "%s%" PRId64 ".%02" PRId64
+#define MONEY_ARGS(m) ((m) < 0 ? "-" : ""), \
+                      ((m) < 0 ? -(m) : (m)) / MONEY_SCALE, \
+                      ((m) < 0 ? -(m) : (m)) % MONEY_SCALE
+
+/**
+ * Parses a decimal amount in dollars such as " 12.99" into cents, rounding any
+ * further decimals to the nearest cent. Stops at the end pointer or the first
+ * character that is not part of the number.
+ */
+money_t money_parse(const char *, const char *);
+
+#endif
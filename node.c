@@ -1,25 +1,223 @@
 #include "node.h"
+#include <pthread.h>
 #include <stdlib.h>
 
+/**
+ * Number of nodes allocated from malloc at once.
+ */
+#define NODES_PER_SLAB 4096
+
+/**
+ * Number of nodes a thread moves to or from the shared pool at once.
+ */
+#define NODE_BATCH 128
+
+/**
+ * Number of free nodes a thread keeps before giving a batch back.
+ */
+#define NODE_CACHE_MAX (4 * NODE_BATCH)
+
+/**
+ * A slab of nodes. Slabs are never freed until node_pool_destroy().
+ */
+typedef struct slab {
+    struct slab *next;
+    node_t nodes[NODES_PER_SLAB];
+} slab_t;
+
+/**
+ * Marks a node that was carved fresh out of a slab and never handed out.
+ */
+#define NODE_FRESH -1
+
+/**
+ * The free nodes owned by one thread, and its counters not yet folded into the
+ * shared pool's counters.
+ */
+typedef struct node_cache {
+    node_t *free;
+    int count;
+    int registered;
+    node_pool_stats_t stats;
+} node_cache_t;
+
+/**
+ * The shared pool that the thread caches trade with.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    node_t *free;
+    slab_t *slabs;
+    int slab_used;
+    node_pool_stats_t stats;
+} pool = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NODES_PER_SLAB, { 0, 0, 0 } };
+
+static __thread node_cache_t cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Folds a thread's counters into the shared counters. Call with the pool mutex
+ * held.
+ */
+static void fold_stats(node_cache_t *c) {
+    pool.stats.hits += c->stats.hits;
+    pool.stats.misses += c->stats.misses;
+    c->stats.hits = 0;
+    c->stats.misses = 0;
+}
+
+/**
+ * Returns the given number of nodes from the front of a thread cache to the
+ * shared pool in one hold of the mutex.
+ */
+static void give_back(node_cache_t *c, int count) {
+    node_t *first, *last;
+    int i;
+
+    if (count <= 0)
+        return;
+    first = last = c->free;
+    for (i = 1; i < count; i++) {
+        last = last->next;
+    }
+    c->free = last->next;
+    c->count -= count;
+
+    pthread_mutex_lock(&pool.mutex);
+    last->next = pool.free;
+    pool.free = first;
+    fold_stats(c);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/**
+ * Runs when a thread exits, handing all of its cached nodes back.
+ */
+static void cache_exit(void *arg) {
+    node_cache_t *c = (node_cache_t *) arg;
+    give_back(c, c->count);
+    pthread_mutex_lock(&pool.mutex);
+    fold_stats(c);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+static void cache_key_create(void) {
+    pthread_key_create(&cache_key, cache_exit);
+}
+
+/**
+ * Makes sure this thread's cache is handed back when the thread exits.
+ */
+static void cache_register(node_cache_t *c) {
+    pthread_once(&cache_once, cache_key_create);
+    pthread_setspecific(cache_key, c);
+    c->registered = 1;
+}
+
+/**
+ * Refills an empty thread cache with a batch of recycled nodes, or failing that
+ * with fresh nodes carved out of a slab. Returns 0 if memory allocation fails.
+ */
+static int refill(node_cache_t *c) {
+    node_t *node;
+    slab_t *slab;
+    int i;
+
+    if (!c->registered)
+        cache_register(c);
+
+    pthread_mutex_lock(&pool.mutex);
+    fold_stats(c);
+    for (i = 0; i < NODE_BATCH && pool.free; i++) {
+        node = pool.free;
+        pool.free = node->next;
+        node->next = c->free;
+        c->free = node;
+    }
+    c->count += i;
+    for (; i < NODE_BATCH; i++) {
+        if (pool.slab_used == NODES_PER_SLAB) {
+            slab = (slab_t *) malloc(sizeof(slab_t));
+            if (!slab)
+                break;
+            slab->next = pool.slabs;
+            pool.slabs = slab;
+            pool.slab_used = 0;
+            pool.stats.slabs++;
+        }
+        node = &pool.slabs->nodes[pool.slab_used++];
+        node->references = NODE_FRESH;
+        node->next = c->free;
+        c->free = node;
+        c->count++;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return c->free != NULL;
+}
+
 /**
  * Creates a new node with the given data. Returns a pointer to a new node, or
- * NULL if memory allocation fails.
+ * NULL if memory allocation fails. Nodes come from this thread's cache, which
+ * only takes the pool mutex once per batch.
  */
 node_t *node_create(void *data, node_t *next) {
-    node_t *node = (node_t *) malloc(sizeof(node_t));
-    if (node) {
-        node->data = data;
-        node->next = next;
-        node->references = 0;
-        return node;
-    }
-    else
+    node_t *node;
+    if (!cache.free && !refill(&cache))
         return NULL;
+
+    node = cache.free;
+    cache.free = node->next;
+    cache.count--;
+    if (node->references == NODE_FRESH)
+        cache.stats.misses++;
+    else
+        cache.stats.hits++;
+
+    node->data = data;
+    node->next = next;
+    node->references = 0;
+    return node;
 }
 
 /**
- * Destroys the node, freeing all associated memory.
+ * Destroys the node, returning it to this thread's cache. Once the cache grows
+ * too large, half of it goes back to the shared pool at once.
  */
 void node_destroy(node_t *node) {
-    free(node);
+    if (!node)
+        return;
+    if (!cache.registered)
+        cache_register(&cache);
+    node->next = cache.free;
+    cache.free = node;
+    if (++cache.count > NODE_CACHE_MAX)
+        give_back(&cache, NODE_CACHE_MAX / 2);
+}
+
+/**
+ * Fills in the node pool counters, including the calling thread's.
+ */
+void node_pool_stats(node_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool.mutex);
+    fold_stats(&cache);
+    *stats = pool.stats;
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+/**
+ * Frees every slab in the node pool.
+ */
+void node_pool_destroy(void) {
+    slab_t *slab;
+    pthread_mutex_lock(&pool.mutex);
+    while ((slab = pool.slabs) != NULL) {
+        pool.slabs = slab->next;
+        free(slab);
+    }
+    pool.free = NULL;
+    pool.slab_used = NODES_PER_SLAB;
+    cache.free = NULL;
+    cache.count = 0;
+    pthread_mutex_unlock(&pool.mutex);
 }
@@ -12,14 +12,36 @@ struct node {
 
 typedef struct node node_t;
 
+/**
+ * Counters for the node pool. A hit is a node recycled from the pool, a miss is
+ * a node carved fresh out of a slab, and slabs counts the calls to malloc.
+ */
+typedef struct node_pool_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long slabs;
+} node_pool_stats_t;
+
 /**
  * Creates a new node with the given data.
  */
 node_t *node_create(void *, node_t *);
 
 /**
- * Destroys the node, freeing all associated memory.
+ * Destroys the node, returning it to the node pool.
  */
 void node_destroy(node_t *);
 
+/**
+ * Fills in the node pool counters. Each thread's counts are folded in whenever
+ * it trades nodes with the shared pool and when it exits.
+ */
+void node_pool_stats(node_pool_stats_t *);
+
+/**
+ * Frees every slab in the node pool. Only call this once every other thread has
+ * exited and no nodes are in use.
+ */
+void node_pool_destroy(void);
+
 #endif
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "queue.h"
+#include "ring.h"
+#include "stats.h"
+
+/**
+ * The size of each thread's buffer. A buffer is handed to the writer once it
+ * has less than OUTPUTSLACK bytes free.
+ */
+#define OUTPUTBUFFER 65536
+#define OUTPUTSLACK 1024
+
+/**
+ * The most buffers written by a single writev call.
+ */
+#define OUTPUTBATCH 64
+
+/**
+ * The most full buffers waiting for the writer. A thread that flushes while
+ * this many are waiting blocks until the writer has caught up, so a slow reader
+ * holds back the workers, and through them the producer, instead of letting
+ * the output pile up in memory.
+ */
+#define OUTPUTQUEUE 16
+
+/**
+ * The most written buffers kept for reuse. Every buffer in use is either held
+ * by a thread, waiting in the queue or being written, so a few dozen spares are
+ * enough to stop allocating once the stream is running.
+ */
+#define OUTPUTSPARES 32
+
+/**
+ * Writes out every iovec, picking up where a short write left off.
+ */
+static void write_all(int fd, struct iovec *iov, int count) {
+    ssize_t written;
+    while (count > 0) {
+        written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("writev");
+            return;
+        }
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/**
+ * Frees the given buffer.
+ */
+static void output_buffer_destroy(void *buffer) {
+    free(((output_buffer_t *) buffer)->data);
+    free(buffer);
+}
+
+/**
+ * Empties the given buffer and keeps it for reuse, or frees it if it has grown
+ * past the usual size or there are enough spares already.
+ */
+static void output_buffer_recycle(output_t *output, output_buffer_t *buffer) {
+    buffer->length = 0;
+    if (buffer->capacity != OUTPUTBUFFER
+            || !ring_try_enqueue(output->spares, buffer))
+        output_buffer_destroy(buffer);
+}
+
+/**
+ * Code for the writer thread. It takes as many buffers as are waiting, writes
+ * them out with one writev call, and recycles them.
+ */
+static void *output_writer(void *args) {
+    output_t *output = (output_t *) args;
+    output_buffer_t *buffers[OUTPUTBATCH];
+    struct iovec iov[OUTPUTBATCH];
+    size_t count, i;
+
+    STATS_THREAD("writer", -1);
+    while ((count = queue_dequeue_batch(output->buffers, (void **) buffers,
+                                        OUTPUTBATCH)) > 0) {
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = buffers[i]->data;
+            iov[i].iov_len = buffers[i]->length;
+        }
+        write_all(output->fd, iov, count);
+        for (i = 0; i < count; i++) {
+            output_buffer_recycle(output, buffers[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Creates a new output stream and starts its writer thread. Returns NULL if
+ * allocation fails.
+ */
+output_t *output_create(int fd, output_mode_t mode) {
+    output_t *output = (output_t *) malloc(sizeof(output_t));
+    if (!output)
+        return NULL;
+    output->fd = fd;
+    output->mode = mode;
+    if ((output->buffers = queue_create_ring(OUTPUTQUEUE)) == NULL) {
+        free(output);
+        return NULL;
+    }
+    if ((output->spares = ring_create(OUTPUTSPARES)) == NULL) {
+        queue_destroy(output->buffers, NULL);
+        free(output);
+        return NULL;
+    }
+    if (pthread_create(&output->writer, NULL, output_writer, output) != 0) {
+        ring_destroy(output->spares);
+        queue_destroy(output->buffers, NULL);
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+/**
+ * Waits for the writer thread to drain its queue, then destroys the stream and
+ * its spare buffers.
+ */
+void output_destroy(output_t *output) {
+    output_buffer_t *buffer;
+    if (output) {
+        queue_close(output->buffers);
+        pthread_join(output->writer, NULL);
+        queue_destroy(output->buffers, NULL);
+        while ((buffer = ring_try_dequeue(output->spares)) != NULL) {
+            output_buffer_destroy(buffer);
+        }
+        ring_destroy(output->spares);
+        free(output);
+    }
+}
+
+/**
+ * Takes a spare buffer, or creates a new, empty one if there is none. Returns
+ * NULL if allocation fails.
+ */
+static output_buffer_t *output_buffer_create(output_t *output) {
+    output_buffer_t *buffer;
+    if ((buffer = ring_try_dequeue(output->spares)) != NULL)
+        return buffer;
+    buffer = (output_buffer_t *) malloc(sizeof(output_buffer_t));
+    if (buffer) {
+        buffer->length = 0;
+        buffer->capacity = OUTPUTBUFFER;
+        if ((buffer->data = (char *) malloc(OUTPUTBUFFER)) == NULL) {
+            free(buffer);
+            buffer = NULL;
+        }
+    }
+    return buffer;
+}
+
+/**
+ * Appends formatted text to the given buffer. A single message longer than the
+ * free space grows the buffer to fit.
+ */
+void output_printf(output_t *output, output_buffer_t **buffer,
+                   const char *format, ...) {
+    va_list args;
+    output_buffer_t *b;
+    char *data;
+    int length;
+
+    if (!*buffer && (*buffer = output_buffer_create(output)) == NULL)
+        return;
+    b = *buffer;
+
+    va_start(args, format);
+    length = vsnprintf(b->data + b->length, b->capacity - b->length,
+                       format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+
+    if ((size_t) length >= b->capacity - b->length) {
+        if ((data = (char *) realloc(b->data, b->length + length + 1)) == NULL)
+            return;
+        b->data = data;
+        b->capacity = b->length + length + 1;
+        va_start(args, format);
+        vsnprintf(b->data + b->length, b->capacity - b->length, format, args);
+        va_end(args);
+    }
+    b->length += length;
+
+    if (b->capacity - b->length < OUTPUTSLACK)
+        output_flush(output, buffer);
+}
+
+/**
+ * Hands the given buffer to the writer. Empty buffers are recycled right away.
+ */
+void output_flush(output_t *output, output_buffer_t **buffer) {
+    if (!*buffer)
+        return;
+    if ((*buffer)->length == 0) {
+        output_buffer_recycle(output, *buffer);
+    }
+    else if (!queue_push(output->buffers, *buffer)) {
+        // The writer has stopped
+        output_buffer_destroy(*buffer);
+    }
+    *buffer = NULL;
+}
+
+/**
+ * Parses an output mode name.
+ */
+int output_mode_parse(const char *name) {
+    if (strcmp(name, "full") == 0)
+        return OUTPUT_FULL;
+    if (strcmp(name, "summary") == 0)
+        return OUTPUT_SUMMARY;
+    if (strcmp(name, "none") == 0)
+        return OUTPUT_NONE;
+    return -1;
+}
@@ -0,0 +1,78 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "queue.h"
+#include "ring.h"
+
+/**
+ * How much to print for every processed order.
+ */
+typedef enum output_mode {
+    OUTPUT_FULL,
+    OUTPUT_SUMMARY,
+    OUTPUT_NONE
+} output_mode_t;
+
+/**
+ * A buffer of formatted output owned by one thread until it is handed to the
+ * writer.
+ */
+typedef struct output_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+} output_buffer_t;
+
+/**
+ * An asynchronous output stream. Threads format their output into their own
+ * buffers without any locking and hand full buffers to a dedicated writer
+ * thread, which writes them out in large writev calls. Buffers from one thread
+ * are written in the order they were handed over. Only a few buffers may wait
+ * for the writer; a thread handing over another one blocks until there is
+ * room. Written buffers are kept as spares for the threads to fill again.
+ */
+typedef struct output {
+    int fd;
+    output_mode_t mode;
+    queue_t *buffers;
+    ring_t *spares;
+    pthread_t writer;
+} output_t;
+
+/**
+ * Creates a new output stream writing to the given file descriptor and starts
+ * its writer thread.
+ */
+output_t *output_create(int, output_mode_t);
+
+/**
+ * Waits for the writer thread to write out every buffer handed to it, then
+ * destroys the output stream. Every thread must have flushed its buffer first.
+ */
+void output_destroy(output_t *);
+
+/**
+ * Appends formatted text to the given buffer, handing it to the writer once it
+ * is full, which blocks while the writer is behind. A thread's buffer starts
+ * out NULL and is created on first use.
+ */
+void output_printf(output_t *, output_buffer_t **, const char *, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * Hands the given buffer to the writer, even if it is not full, and leaves NULL
+ * in its place, blocking while the writer is behind. Threads must flush their
+ * buffer before they exit.
+ */
+void output_flush(output_t *, output_buffer_t **);
+
+/**
+ * Parses an output mode name: "full", "summary" or "none". Returns -1 if the
+ * name is not recognized.
+ */
+int output_mode_parse(const char *);
+
+#endif
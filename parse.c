@@ -0,0 +1,254 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "books.h"
+#include "parse.h"
+#include "queue.h"
+#include "scan.h"
+#include "stats.h"
+
+/**
+ * The number of fields on each line of an order file.
+ */
+#define ORDERFIELDS 4
+
+/**
+ * Maps the order file at the given path. Returns NULL if the file cannot be
+ * opened or mapped.
+ */
+order_file_t *order_file_open(const char *path) {
+    int fd;
+    struct stat st;
+    void *data;
+    order_file_t *file;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    file = (order_file_t *) malloc(sizeof(order_file_t));
+    if (!file) {
+        if (data)
+            munmap(data, st.st_size);
+        return NULL;
+    }
+    file->data = (const char *) data;
+    file->length = st.st_size;
+    return file;
+}
+
+/**
+ * Unmaps the order file.
+ */
+void order_file_close(order_file_t *file) {
+    if (file) {
+        if (file->data)
+            munmap((void *) file->data, file->length);
+        free(file);
+    }
+}
+
+/**
+ * Creates an order from a line split by the scanner, or returns NULL if the
+ * line has too few fields.
+ */
+static order_t *order_from_line(const char *data, const scan_line_t *line) {
+    const char *p = data + line->start;
+
+    if (line->num_fields < ORDERFIELDS)
+        return NULL;
+    return order_create_view(p + line->field[0],
+                             line->field_end[0] - line->field[0],
+                             money_parse(p + line->field[1],
+                                         p + line->field_end[1]),
+                             parse_long(p + line->field[2],
+                                        p + line->field_end[2]),
+                             p + line->field[3],
+                             line->field_end[3] - line->field[3]);
+}
+
+/**
+ * Parses a batch of lines from the mapping. The lines are split in a single
+ * pass before any order is created.
+ */
+size_t order_file_parse(order_file_t *file, size_t *position, size_t end,
+                        order_t **orders) {
+    scan_line_t lines[SCANBATCH];
+    const char *data;
+    size_t count, i, num_lines;
+    order_t *order;
+
+    if (end > file->length)
+        end = file->length;
+    if (*position >= end)
+        return 0;
+
+    data = file->data + *position;
+    num_lines = scan_lines(data, end - *position, lines, SCANBATCH);
+    count = 0;
+    for (i = 0; i < num_lines; i++) {
+        if ((order = order_from_line(data, &lines[i])) == NULL)
+            continue;
+        order->end_offset = *position + lines[i].next;
+        orders[count++] = order;
+    }
+    *position += lines[num_lines - 1].next;
+    return count;
+}
+
+/**
+ * Parses a single order line into an order pointing into the line.
+ */
+order_t *order_parse_line(const char *line, const char *end) {
+    scan_line_t scanned;
+
+    if (scan_lines(line, end - line, &scanned, 1) == 0)
+        return NULL;
+    return order_from_line(line, &scanned);
+}
+
+/**
+ * Splits the order file into the given number of chunks. Each boundary is moved
+ * forward to just past the next newline so that no line is split.
+ */
+order_chunk_t *order_file_split(order_file_t *file, int num_chunks,
+                                size_t offset) {
+    const char *newline;
+    int i;
+    size_t start, end, length;
+    order_chunk_t *chunks;
+
+    chunks = (order_chunk_t *) calloc(num_chunks, sizeof(order_chunk_t));
+    if (!chunks)
+        return NULL;
+
+    start = offset < file->length ? offset : file->length;
+    length = file->length - start;
+    for (i = 0; i < num_chunks; i++) {
+        end = i == num_chunks - 1
+              ? file->length
+              : file->length - length + length / num_chunks * (i + 1);
+        if (end < start)
+            end = start;
+        if (end > 0 && end < file->length && file->data[end - 1] != '\n') {
+            newline = memchr(file->data + end, '\n', file->length - end);
+            end = newline ? (size_t) (newline - file->data) + 1 : file->length;
+        }
+        chunks[i].index = i;
+        chunks[i].file = file;
+        chunks[i].start = start;
+        chunks[i].end = end;
+        if ((chunks[i].orders = queue_create_ring(CHUNKCAPACITY)) == NULL) {
+            order_chunks_destroy(chunks, i);
+            return NULL;
+        }
+        start = end;
+    }
+    return chunks;
+}
+
+/**
+ * Destroys the given number of chunks and any orders left in them.
+ */
+void order_chunks_destroy(order_chunk_t *chunks, int num_chunks) {
+    int i;
+    if (chunks) {
+        for (i = 0; i < num_chunks; i++) {
+            queue_destroy(chunks[i].orders, (void (*)(void *)) &order_destroy);
+        }
+        free(chunks);
+    }
+}
+
+/**
+ * Hands a batch of parsed orders to the chunk's queue. Orders the queue does
+ * not take, because it was closed or ran out of memory, are destroyed. Returns
+ * the number of orders handed over.
+ */
+static size_t order_chunk_hand_over(order_chunk_t *chunk, order_t **batch,
+                                    size_t count) {
+    size_t i, taken;
+    taken = queue_enqueue_batch(chunk->orders, (void **) batch, count);
+    for (i = taken; i < count; i++) {
+        order_destroy(batch[i]);
+    }
+    return taken;
+}
+
+/**
+ * Code for the parser threads. Orders are collected into batches so that the
+ * chunk's queue mutex is taken once per batch; a batch is handed over once it
+ * has no room for another scan.
+ */
+void *order_chunk_parse(void *args) {
+    order_chunk_t *chunk = (order_chunk_t *) args;
+    order_t *order, *batch[CHUNKBATCH];
+    size_t count, i, parsed, position;
+
+    STATS_THREAD("parser", chunk->index);
+    count = 0;
+    position = chunk->start;
+    while (position < chunk->end) {
+        STATS_TIMED(STAT_PARSE_NS,
+                    parsed = order_file_parse(chunk->file, &position,
+                                              chunk->end, batch + count));
+        STATS_ADD(STAT_ORDERS_PARSED, parsed);
+        for (i = count; i < count + parsed; i++) {
+            order = batch[i];
+            if (chunk->titles)
+                order_intern(order, chunk->titles);
+            if (chunk->categories)
+                order->category_id = category_table_find(
+                        chunk->categories, order->category,
+                        order->category_length);
+        }
+        count += parsed;
+        if (count > CHUNKBATCH - SCANBATCH) {
+            if (order_chunk_hand_over(chunk, batch, count) < count) {
+                queue_close(chunk->orders);
+                return NULL;
+            }
+            count = 0;
+        }
+    }
+    order_chunk_hand_over(chunk, batch, count);
+    queue_close(chunk->orders);
+    return NULL;
+}
+
+/**
+ * Parses a decimal integer.
+ */
+long parse_long(const char *p, const char *end) {
+    long value;
+    int negative;
+
+    while (p < end && *p == ' ')
+        p++;
+    negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    return negative ? -value : value;
+}
@@ -0,0 +1,107 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+
+#include "books.h"
+#include "category.h"
+#include "queue.h"
+
+/**
+ * The number of orders a parser thread hands over at once.
+ */
+#define CHUNKBATCH 256
+
+/**
+ * The most lines of an order file split into fields in one pass.
+ */
+#define SCANBATCH 64
+
+/**
+ * The most parsed orders a chunk holds before its parser thread waits for the
+ * merge to catch up.
+ */
+#define CHUNKCAPACITY (4 * CHUNKBATCH)
+
+/**
+ * An order file mapped read-only into memory. Orders parsed from it point
+ * straight into the mapping, so it must stay open until they are all gone.
+ */
+typedef struct order_file {
+    const char *data;
+    size_t length;
+} order_file_t;
+
+/**
+ * Maps the order file at the given path. Returns NULL if the file cannot be
+ * opened or mapped.
+ */
+order_file_t *order_file_open(const char *);
+
+/**
+ * Unmaps the order file.
+ */
+void order_file_close(order_file_t *);
+
+/**
+ * Parses up to SCANBATCH lines, starting at the given position and ending no
+ * later than the given end offset, into new orders whose titles and categories
+ * point into the mapping. The orders are stored in the array, which must have
+ * room for SCANBATCH of them, and the position is moved past the last line.
+ * Each order's end offset is where its line ends. Blank and malformed lines
+ * are skipped. Returns the number of orders, which is zero at the end of the
+ * file but may also be zero before it; the position tells the two apart.
+ */
+size_t order_file_parse(order_file_t *, size_t *, size_t, order_t **);
+
+/**
+ * Parses the order line between the two pointers, which does not include its
+ * newline, into a new order whose title and category point into the line.
+ * Returns NULL for a blank or malformed line.
+ */
+order_t *order_parse_line(const char *, const char *);
+
+/**
+ * A slice of an order file that starts and ends on line boundaries. A parser
+ * thread fills the chunk's queue with its orders, in file order, and closes it
+ * when the chunk is done. The queue is bounded, so a parser that runs ahead of
+ * the merge waits instead of parsing its whole chunk into memory. If the chunk
+ * has a catalog, the parser interns each order's title in it, and if it has a
+ * category table, it looks up each order's category ID, so that the parsers
+ * share that work.
+ */
+typedef struct order_chunk {
+    int index;
+    order_file_t *file;
+    size_t start;
+    size_t end;
+    queue_t *orders;
+    catalog_t *titles;
+    category_table_t *categories;
+} order_chunk_t;
+
+/**
+ * Splits the order file from the given offset on into the given number of
+ * chunks of about the same size. The offset must be at the beginning of a line,
+ * as every chunk is; some may be empty.
+ */
+order_chunk_t *order_file_split(order_file_t *, int, size_t);
+
+/**
+ * Destroys the given number of chunks and any orders left in them.
+ */
+void order_chunks_destroy(order_chunk_t *, int);
+
+/**
+ * Code for the parser threads. The argument is an order_chunk_t, whose orders
+ * are parsed and handed over to its queue in batches.
+ */
+void *order_chunk_parse(void *);
+
+/**
+ * Parses a decimal integer such as " 42" without going through atol. Stops at
+ * the end pointer or the first character that is not part of the number.
+ */
+long parse_long(const char *, const char *);
+
+#endif
@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "books.h"
+#include "pool.h"
+#include "queue.h"
+#include "stats.h"
+
+/**
+ * The most orders a worker applies for one customer before putting the
+ * customer back on its run queue, so that a busy customer cannot starve others.
+ */
+#define POOLSLICE 256
+
+/**
+ * Returns nonzero if the in-flight orders are at or above the given fraction,
+ * in quarters, of the pool's limits.
+ */
+static int pool_over(pool_t *pool, int quarters) {
+    long inflight = atomic_load_explicit(&pool->inflight, memory_order_relaxed);
+    size_t bytes = atomic_load_explicit(&pool->inflight_bytes,
+                                        memory_order_relaxed);
+    return (pool->max_inflight && inflight * 4 >= pool->max_inflight * quarters)
+        || (pool->max_inflight_bytes
+            && bytes * 4 >= pool->max_inflight_bytes * quarters);
+}
+
+/**
+ * Returns the given number of applied orders and bytes to the in-flight budget.
+ * A blocked submitter is only woken once the pool has drained to three
+ * quarters of its limits, so that it is not woken for every single order.
+ */
+static void pool_release(pool_t *pool, long orders, size_t bytes) {
+    atomic_fetch_sub_explicit(&pool->inflight, orders, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&pool->inflight_bytes, bytes,
+                              memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->submitter_waiting, memory_order_relaxed)
+            && !pool_over(pool, 3)) {
+        STATS_LOCK(&pool->mutex, STATS_POOL_LOCK);
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * Blocks the submitter while the pool is at its in-flight limit, and adds the
+ * time spent blocked to the pool's statistics. Once blocked, the submitter
+ * waits for the pool to drain to three quarters of its limits.
+ */
+static void pool_throttle(pool_t *pool) {
+    struct timespec start, end;
+    int waits = 0;
+
+    if (!pool_over(pool, 4))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    STATS_LOCK(&pool->mutex, STATS_POOL_LOCK);
+    atomic_store(&pool->submitter_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (pool_over(pool, 3)) {
+        STATS_COND_WAIT(&pool->not_full, &pool->mutex, waits);
+    }
+    atomic_store(&pool->submitter_waiting, 0);
+    pthread_mutex_unlock(&pool->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pool->blocked_count++;
+    pool->blocked_seconds += (end.tv_sec - start.tv_sec)
+                             + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Wakes up one idle worker if there is any and none is being woken already.
+ * The fence pairs with the one in pool_wait(): either the idle worker sees the
+ * new work, or we see it idle. Under the mutex every idle worker is really
+ * waiting on the condition, so the signal is sure to reach one of them, and
+ * that one clears the waking flag.
+ */
+static void pool_wake(pool_t *pool) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0
+            && !atomic_load_explicit(&pool->waking, memory_order_relaxed)) {
+        STATS_LOCK(&pool->mutex, STATS_POOL_LOCK);
+        if (atomic_load(&pool->idle) > 0 && !atomic_load(&pool->waking)) {
+            atomic_store(&pool->waking, 1);
+            pthread_cond_signal(&pool->has_work);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * Puts a customer at the end of the given worker's run queue. A customer that
+ * cannot be queued would never be run again, so the program exits instead.
+ */
+static void pool_push(pool_t *pool, worker_t *worker, customer_t *customer) {
+    if (!queue_push(worker->queue, customer)) {
+        fprintf(stderr, "Error: could not schedule customer %ld\n",
+                customer->customer_id);
+        exit(EXIT_FAILURE);
+    }
+    atomic_fetch_add(&pool->queued, 1);
+    pool_wake(pool);
+}
+
+/**
+ * Takes the customer at the head of the worker's own run queue, or steals the
+ * one at the head of another worker's, starting with its neighbour. Returns
+ * NULL if every run queue is empty.
+ */
+static customer_t *pool_take(pool_t *pool, worker_t *worker) {
+    customer_t *customer;
+    int i;
+
+    for (i = 0; i < pool->num_workers; i++) {
+        customer = (customer_t *) queue_try_pop(
+                pool->workers[(worker->index + i) % pool->num_workers].queue);
+        if (customer) {
+            if (i > 0)
+                worker->steals++;
+            atomic_fetch_sub(&pool->queued, 1);
+            return customer;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Puts the worker to sleep until there may be work for it. Returns 0 once the
+ * pool is finished and every customer has been drained.
+ */
+static int pool_wait(pool_t *pool) {
+    int running = 1, waits = 0;
+    STATS_LOCK(&pool->mutex, STATS_POOL_LOCK);
+    atomic_fetch_add(&pool->idle, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load(&pool->queued) == 0) {
+        if (atomic_load(&pool->done) && atomic_load(&pool->scheduled) == 0) {
+            running = 0;
+            break;
+        }
+        STATS_COND_WAIT(&pool->has_work, &pool->mutex, waits);
+        atomic_store(&pool->waking, 0);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    pthread_mutex_unlock(&pool->mutex);
+    return running;
+}
+
+/**
+ * Applies up to a slice of the customer's pending orders, in order. If more
+ * orders are left the customer goes back on this worker's run queue; otherwise
+ * it is unscheduled and the next order submitted for it schedules it again.
+ * The worker flushes before either, since from then on another worker may
+ * apply the customer's next orders.
+ */
+static void pool_run(pool_t *pool, worker_t *worker, customer_t *customer) {
+    order_t *order, *next;
+    size_t bytes;
+    int count;
+
+    database_lock_customer(pool->database, customer);
+    order = customer->pending;
+    customer->pending = customer->pending_tail = NULL;
+    database_unlock_customer(pool->database, customer);
+
+    bytes = 0;
+    for (count = 0; order && count < POOLSLICE; count++) {
+        next = order->next;
+        bytes += order_size(order);
+        STATS_STAMP(order, STAGE_DEQUEUED);
+        pool->process(order, worker->index);
+        order = next;
+    }
+    pool_release(pool, count, bytes);
+    if (pool->flush_hook)
+        pool->flush_hook(worker->index);
+
+    database_lock_customer(pool->database, customer);
+    if (order) {
+        // Put the rest back in front of anything submitted meanwhile
+        for (next = order; next->next; next = next->next)
+            ;
+        next->next = customer->pending;
+        if (!customer->pending)
+            customer->pending_tail = next;
+        customer->pending = order;
+    }
+    if (customer->pending) {
+        database_unlock_customer(pool->database, customer);
+        pool_push(pool, worker, customer);
+        return;
+    }
+    customer->scheduled = 0;
+    database_unlock_customer(pool->database, customer);
+
+    if (atomic_fetch_sub(&pool->scheduled, 1) == 1 && atomic_load(&pool->done)) {
+        // That was the last customer; let the idle workers exit
+        STATS_LOCK(&pool->mutex, STATS_POOL_LOCK);
+        pthread_cond_broadcast(&pool->has_work);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * Code for the worker threads.
+ */
+static void *pool_worker(void *args) {
+    worker_t *worker = (worker_t *) args;
+    pool_t *pool = worker->pool;
+    customer_t *customer;
+
+    STATS_THREAD("worker", worker->index);
+    for (;;) {
+        if ((customer = pool_take(pool, worker)) != NULL) {
+            // Pass the wake on while there is more work than this worker
+            if (atomic_load_explicit(&pool->queued, memory_order_relaxed) > 0)
+                pool_wake(pool);
+            pool_run(pool, worker, customer);
+            continue;
+        }
+        if (!pool_wait(pool))
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * Creates a pool with the given number of workers and starts them. Returns
+ * NULL if allocation fails.
+ */
+pool_t *pool_create(database_t *database, int num_workers,
+                    pool_process_t process, pool_flush_t flush_hook,
+                    long max_inflight, size_t max_inflight_bytes) {
+    int i;
+    pool_t *pool = (pool_t *) malloc(sizeof(pool_t));
+    if (!pool)
+        return NULL;
+
+    pool->workers = (worker_t *) calloc(num_workers, sizeof(worker_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->num_workers = num_workers;
+    pool->database = database;
+    pool->process = process;
+    pool->flush_hook = flush_hook;
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->scheduled, 0);
+    atomic_init(&pool->idle, 0);
+    atomic_init(&pool->waking, 0);
+    atomic_init(&pool->done, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pool->max_inflight = max_inflight;
+    pool->max_inflight_bytes = max_inflight_bytes;
+    atomic_init(&pool->inflight, 0);
+    atomic_init(&pool->inflight_bytes, 0);
+    atomic_init(&pool->submitter_waiting, 0);
+    pthread_cond_init(&pool->not_full, NULL);
+    pool->peak_inflight = 0;
+    pool->peak_inflight_bytes = 0;
+    pool->blocked_count = 0;
+    pool->blocked_seconds = 0;
+
+    for (i = 0; i < num_workers; i++) {
+        pool->workers[i].index = i;
+        pool->workers[i].pool = pool;
+        pool->workers[i].steals = 0;
+        pool->workers[i].queue = queue_create();
+    }
+    for (i = 0; i < num_workers; i++) {
+        pthread_create(&pool->workers[i].thread, NULL, pool_worker,
+                       &pool->workers[i]);
+    }
+    return pool;
+}
+
+/**
+ * Appends the order to its customer's pending list, once the pool has room for
+ * it. A customer that was not scheduled goes onto the run queue of the worker
+ * its ID hashes to, which keeps a customer on the same worker while the load is
+ * even.
+ */
+void pool_submit(pool_t *pool, customer_t *customer, order_t *order) {
+    int schedule;
+    long inflight;
+    size_t bytes;
+
+    pool_throttle(pool);
+    inflight = atomic_fetch_add(&pool->inflight, 1) + 1;
+    bytes = atomic_fetch_add(&pool->inflight_bytes, order_size(order))
+            + order_size(order);
+    if (inflight > pool->peak_inflight)
+        pool->peak_inflight = inflight;
+    STATS_MAX(STAT_INFLIGHT_PEAK, inflight);
+    if (bytes > pool->peak_inflight_bytes)
+        pool->peak_inflight_bytes = bytes;
+
+    order->next = NULL;
+    STATS_STAMP(order, STAGE_ENQUEUED);
+    database_lock_customer(pool->database, customer);
+    if (customer->pending_tail)
+        customer->pending_tail->next = order;
+    else
+        customer->pending = order;
+    customer->pending_tail = order;
+    schedule = !customer->scheduled;
+    if (schedule) {
+        customer->scheduled = 1;
+        atomic_fetch_add(&pool->scheduled, 1);
+    }
+    database_unlock_customer(pool->database, customer);
+
+    if (schedule) {
+        pool_push(pool, &pool->workers[(unsigned long) customer->customer_id
+                                       % pool->num_workers], customer);
+    }
+}
+
+/**
+ * Tells the workers no more orders will be submitted and waits for them.
+ */
+void pool_finish(pool_t *pool) {
+    int i;
+    STATS_LOCK(&pool->mutex, STATS_POOL_LOCK);
+    atomic_store(&pool->done, 1);
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+}
+
+/**
+ * Destroys the pool.
+ */
+void pool_destroy(pool_t *pool) {
+    int i;
+    if (pool) {
+        for (i = 0; i < pool->num_workers; i++) {
+            queue_destroy(pool->workers[i].queue, NULL);
+        }
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->has_work);
+        pthread_cond_destroy(&pool->not_full);
+        free(pool->workers);
+        free(pool);
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "books.h"
+#include "queue.h"
+
+struct pool;
+
+/**
+ * A worker thread in the pool. Its run queue is a FIFO queue, guarded by the
+ * queue's mutex, of customers that have orders waiting. A worker takes from
+ * the head of its own queue, and when that is empty steals from the head of
+ * another worker's, so a stolen customer is the one that has waited longest.
+ */
+typedef struct worker {
+    int index;
+    struct pool *pool;
+    queue_t *queue;
+    pthread_t thread;
+    unsigned long steals;
+} worker_t;
+
+/**
+ * Function called by a worker to apply one order. The second argument is the
+ * index of the worker, for keeping per-worker state without locking.
+ */
+typedef void (*pool_process_t)(order_t *, int);
+
+/**
+ * Function called by a worker, with its index, after each slice of a
+ * customer's orders, before the customer is put back or let go and another
+ * worker can take it. Anything the slice wrote into per-worker buffers must be
+ * handed on by then, so that the next worker's output for the customer cannot
+ * get out first.
+ */
+typedef void (*pool_flush_t)(int);
+
+/**
+ * A fixed-size pool of worker threads serving every category.
+ *
+ * The unit of work is a customer, not an order. Orders are appended to their
+ * customer's pending list, and a customer with pending orders sits in exactly
+ * one run queue or is being worked on by exactly one worker until its list runs
+ * dry. So a customer's orders are always applied one at a time, in the order
+ * they were submitted, no matter which workers end up running them, while
+ * different customers are processed in parallel.
+ *
+ * Idle workers sleep on the has_work condition. At most one of them is being
+ * woken at any time: the waking flag is set when one is signalled and cleared
+ * once it runs, and a woken worker that finds more work queued wakes the next
+ * one. A burst of submissions therefore wakes workers one by one, as long as
+ * there is work for them, instead of waking every idle worker for every
+ * customer scheduled.
+ *
+ * The number of orders submitted but not yet applied, and the heap bytes they
+ * hold, can be capped. The submitter then blocks on the not_full condition
+ * until the workers have caught up, so a slow worker holds back the producer
+ * instead of letting the whole order file pile up in memory.
+ */
+typedef struct pool {
+    worker_t *workers;
+    int num_workers;
+    database_t *database;
+    pool_process_t process;
+    pool_flush_t flush_hook;
+    atomic_long queued;
+    atomic_long scheduled;
+    atomic_int idle;
+    atomic_int waking;
+    atomic_int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t has_work;
+    // Backpressure on the submitter; a limit of zero means no limit
+    long max_inflight;
+    size_t max_inflight_bytes;
+    atomic_long inflight;
+    atomic_size_t inflight_bytes;
+    atomic_int submitter_waiting;
+    pthread_cond_t not_full;
+    // Only touched by the submitter
+    long peak_inflight;
+    size_t peak_inflight_bytes;
+    long blocked_count;
+    double blocked_seconds;
+} pool_t;
+
+/**
+ * Creates a pool with the given number of workers and starts them. The flush
+ * function may be NULL. At most the given number of orders, holding at most
+ * the given number of bytes, may be in flight at once; zero means no limit.
+ */
+pool_t *pool_create(database_t *, int, pool_process_t, pool_flush_t, long,
+                    size_t);
+
+/**
+ * Submits an order for the given customer, blocking while the pool is at its
+ * in-flight limit. Only one thread may submit orders, so that each customer's
+ * orders keep their submission order.
+ */
+void pool_submit(pool_t *, customer_t *, order_t *);
+
+/**
+ * Tells the workers no more orders will be submitted, then waits for them to
+ * apply every pending order and exit.
+ */
+void pool_finish(pool_t *);
+
+/**
+ * Destroys the pool. Call pool_finish() first.
+ */
+void pool_destroy(pool_t *);
+
+#endif
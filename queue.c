@@ -2,6 +2,8 @@
 
 #include "node.h"
 #include "queue.h"
+#include "ring.h"
+#include "stats.h"
 #include <pthread.h>
 
 /**
@@ -11,6 +13,9 @@ queue_t *queue_create(void) {
     queue_t *q = (queue_t *) malloc(sizeof(queue_t));
     if (q) {
         q->last = NULL;
+        q->size = 0;
+        q->ring = NULL;
+        q->closed = 0;
         if (pthread_mutex_init(&q->mutex, NULL) != 0) {
             free(q);
             q = NULL;
@@ -25,14 +30,33 @@ queue_t *queue_create(void) {
 }
 
 /**
- * Enqueues the given data into the queue.
+ * Creates a new queue backed by a lock-free ring buffer. Returns NULL if memory
+ * allocation fails.
  */
-void queue_enqueue(queue_t *queue, void *data) {
+queue_t *queue_create_ring(size_t capacity) {
+    queue_t *q = queue_create();
+    if (q && (q->ring = ring_create(capacity)) == NULL) {
+        queue_destroy(q, NULL);
+        q = NULL;
+    }
+    return q;
+}
+
+/**
+ * Enqueues the given data into the queue. Ring buffers block while full, and
+ * refuse the data once closed.
+ */
+int queue_enqueue(queue_t *queue, void *data) {
     node_t *node;
     if (!queue)
-        return;
+        return 0;
+    if (queue->ring)
+        return ring_enqueue(queue->ring, data);
 
-    node = node_create(data, NULL);
+    if ((node = node_create(data, NULL)) == NULL)
+        return 0;
+    queue->size++;
+    STATS_MAX(STAT_QUEUE_PEAK, queue->size);
     if (queue->last == NULL) {
         // Queue is empty
         queue->last = node;
@@ -44,6 +68,7 @@ void queue_enqueue(queue_t *queue, void *data) {
         queue->last->next = node;
         queue->last = node;
     }
+    return 1;
 }
 
 /**
@@ -56,10 +81,14 @@ void *queue_dequeue(queue_t *queue) {
     void *data;
     node_t *to_destroy;
 
+    if (queue && queue->ring) {
+        return ring_try_dequeue(queue->ring);
+    }
     if (queue == NULL || queue->last == NULL) {
         return NULL;
     }
 
+    queue->size--;
     if (!queue->last->next || queue->last == queue->last->next) {
         // Only one item left in the queue
         data = queue->last->data;
@@ -82,30 +111,16 @@ void *queue_dequeue(queue_t *queue) {
  * specified queue.
  */
 void queue_destroy(queue_t *queue, void (*destroy_func)(void *)) {
-    node_t *node, *next;
+    void *data;
     if (queue) {
-        pthread_mutex_destroy(&queue->mutex);
-        pthread_cond_destroy(&queue->nonempty);
-
-        if (!queue->last) {
-            // Empty queue, so do nothing
-        }
-        else if (queue->last == queue->last->next) {
-            // Special case: size one queue
-            node_destroy(queue->last);
-        }
-        else {
-            // Walk the linked list
-            node = queue->last;
-            while(node) {
-                next = node->next;
-                if (destroy_func) {
-                    destroy_func(node->data);
-                }
-                node_destroy(node);
-                node = next;
+        while ((data = queue_dequeue(queue)) != NULL) {
+            if (destroy_func) {
+                destroy_func(data);
             }
         }
+        ring_destroy(queue->ring);
+        pthread_mutex_destroy(&queue->mutex);
+        pthread_cond_destroy(&queue->nonempty);
         free(queue);
     }
 }
@@ -114,6 +129,8 @@ void queue_destroy(queue_t *queue, void (*destroy_func)(void *)) {
  * Returns true if the queue is NULL or is empty and false otherwise.
  */
 int queue_isempty(queue_t *queue) {
+    if (queue && queue->ring)
+        return ring_size(queue->ring) == 0;
     return queue == NULL || queue->last == NULL;
 }
 
@@ -122,10 +139,158 @@ int queue_isempty(queue_t *queue) {
  * the queue, this returns NULL. This is a non-blocking function.
  */
 const void *queue_peek(queue_t *queue) {
-    if (queue && queue->last && queue->last->next) {
+    if (queue && queue->ring) {
+        return ring_peek(queue->ring);
+    }
+    else if (queue && queue->last && queue->last->next) {
         return queue->last->next->data;
     }
     else {
         return NULL;
     }
 }
+
+/**
+ * Enqueues the given data and wakes up one waiting consumer. The ring buffer
+ * does its own signalling, so only the linked list needs the mutex.
+ */
+int queue_push(queue_t *queue, void *data) {
+    int enqueued;
+    if (queue->ring) {
+        enqueued = ring_enqueue(queue->ring, data);
+        STATS_MAX(STAT_QUEUE_PEAK, ring_size(queue->ring));
+        return enqueued;
+    }
+    STATS_LOCK(&queue->mutex, STATS_QUEUE_LOCK);
+    enqueued = queue_enqueue(queue, data);
+    pthread_mutex_unlock(&queue->mutex);
+    if (enqueued)
+        pthread_cond_signal(&queue->nonempty);
+    return enqueued;
+}
+
+/**
+ * Dequeues the data at the front of the queue, blocking on the nonempty
+ * condition until there is something to dequeue or the queue is closed.
+ */
+void *queue_pop(queue_t *queue) {
+    void *data;
+    int waits = 0;
+    if (queue->ring) {
+        return ring_dequeue(queue->ring);
+    }
+    STATS_LOCK(&queue->mutex, STATS_QUEUE_LOCK);
+    while (!queue->closed && queue_isempty(queue)) {
+        STATS_COND_WAIT(&queue->nonempty, &queue->mutex, waits);
+    }
+    data = queue_dequeue(queue);
+    pthread_mutex_unlock(&queue->mutex);
+    return data;
+}
+
+/**
+ * Dequeues the data at the front of the queue without waiting.
+ */
+void *queue_try_pop(queue_t *queue) {
+    void *data;
+    if (queue->ring) {
+        return ring_try_dequeue(queue->ring);
+    }
+    STATS_LOCK(&queue->mutex, STATS_QUEUE_LOCK);
+    data = queue_dequeue(queue);
+    pthread_mutex_unlock(&queue->mutex);
+    return data;
+}
+
+/**
+ * Closes the queue and wakes up every consumer blocked in queue_pop().
+ */
+void queue_close(queue_t *queue) {
+    if (queue->ring) {
+        ring_close(queue->ring);
+        return;
+    }
+    STATS_LOCK(&queue->mutex, STATS_QUEUE_LOCK);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->nonempty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * Enqueues all of the given data in order under one hold of the mutex. A lone
+ * item wakes one consumer; a batch wakes them all since there may be enough
+ * work for several.
+ */
+size_t queue_enqueue_batch(queue_t *queue, void **items, size_t count) {
+    size_t i;
+    if (count == 0)
+        return 0;
+    if (queue->ring) {
+        i = ring_enqueue_batch(queue->ring, items, count);
+        STATS_MAX(STAT_QUEUE_PEAK, ring_size(queue->ring));
+        return i;
+    }
+    STATS_LOCK(&queue->mutex, STATS_QUEUE_LOCK);
+    for (i = 0; i < count; i++) {
+        if (!queue_enqueue(queue, items[i]))
+            break;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    if (i == 1)
+        pthread_cond_signal(&queue->nonempty);
+    else if (i > 1)
+        pthread_cond_broadcast(&queue->nonempty);
+    return i;
+}
+
+/**
+ * Dequeues up to the given number of items under one hold of the mutex,
+ * blocking on the nonempty condition until there is at least one.
+ */
+size_t queue_dequeue_batch(queue_t *queue, void **items, size_t max) {
+    size_t count;
+    int waits = 0;
+    if (queue->ring) {
+        return ring_dequeue_batch(queue->ring, items, max);
+    }
+    STATS_LOCK(&queue->mutex, STATS_QUEUE_LOCK);
+    while (!queue->closed && queue_isempty(queue)) {
+        STATS_COND_WAIT(&queue->nonempty, &queue->mutex, waits);
+    }
+    for (count = 0; count < max && !queue_isempty(queue); count++) {
+        items[count] = queue_dequeue(queue);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+/**
+ * Returns the number of items in the queue.
+ */
+size_t queue_size(queue_t *queue) {
+    if (queue->ring)
+        return ring_size(queue->ring);
+    return queue->size;
+}
+
+/**
+ * Starts a batch size at one item, allowing it to grow up to the given maximum.
+ */
+void batch_init(batch_t *batch, size_t max) {
+    batch->size = 1;
+    batch->max = max;
+}
+
+/**
+ * Adapts the batch size to the given queue depth.
+ */
+void batch_adapt(batch_t *batch, size_t depth) {
+    if (depth > batch->size && batch->size < batch->max) {
+        batch->size *= 2;
+        if (batch->size > batch->max)
+            batch->size = batch->max;
+    }
+    else if (depth == 0 && batch->size > 1) {
+        batch->size /= 2;
+    }
+}
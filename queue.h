@@ -2,15 +2,21 @@
 #define QUEUE_H
 
 #include "node.h"
+#include "ring.h"
 #include <pthread.h>
+#include <stddef.h>
 
 /**
- * Type for a synchronized queue. This is implemented as a linked list and
- * contains mutexes to implement synchronized enqueue and dequeue methods.
+ * Type for a synchronized queue. This is implemented either as a linked list
+ * protected by the mutex, or as a fixed-capacity lock-free ring buffer when
+ * created with queue_create_ring().
  */
 typedef struct queue {
     // TODO need thing for shared memory
     node_t *last;
+    size_t size;
+    ring_t *ring;
+    int closed;
     pthread_mutex_t mutex;
     pthread_cond_t nonempty;
 } queue_t;
@@ -20,11 +26,19 @@ typedef struct queue {
  */
 queue_t *queue_create(void);
 
+/**
+ * Creates a new queue, initially empty, backed by a lock-free ring buffer that
+ * holds at most the given number of items (rounded up to a power of two).
+ */
+queue_t *queue_create_ring(size_t);
+
 /**
  * Enqueues the given data into the queue in a synchronized fashion. This call
- * will block until the data structure is safe to modify.
+ * will block until the data structure is safe to modify. Returns 1 if the data
+ * was enqueued, or 0 if it was not because the ring buffer was closed or memory
+ * allocation failed; the data then still belongs to the caller.
  */
-void queue_enqueue(queue_t *, void *);
+int queue_enqueue(queue_t *, void *);
 
 /**
  * Dequeues the data at the front of the queue, or NULL if there are no more
@@ -50,4 +64,72 @@ int queue_isempty(queue_t *);
  */
 const void *queue_peek(queue_t *);
 
+/**
+ * Enqueues the given data and wakes up one waiting consumer. Unlike
+ * queue_enqueue(), this takes care of synchronization itself: the linked list
+ * takes the queue's mutex, and the ring buffer only sleeps if it is full.
+ * Returns 1 if the data was enqueued, or 0 as queue_enqueue() does.
+ */
+int queue_push(queue_t *, void *);
+
+/**
+ * Dequeues the data at the front of the queue, blocking until there is
+ * something to dequeue. Returns NULL once the queue has been closed and
+ * drained. Like queue_push(), this takes care of synchronization itself.
+ */
+void *queue_pop(queue_t *);
+
+/**
+ * Enqueues all of the given data in order while holding the queue's mutex
+ * once, then wakes up the consumers once for the whole batch. Returns the
+ * number of items enqueued; any after those still belong to the caller.
+ */
+size_t queue_enqueue_batch(queue_t *, void **, size_t);
+
+/**
+ * Dequeues up to the given number of items while holding the queue's mutex
+ * once, blocking until at least one item is available. Returns the number of
+ * items dequeued, or zero once the queue has been closed and drained.
+ */
+size_t queue_dequeue_batch(queue_t *, void **, size_t);
+
+/**
+ * Returns the number of items in the queue. Without holding the queue's mutex
+ * this is only a snapshot.
+ */
+size_t queue_size(queue_t *);
+
+/**
+ * Dequeues the data at the front of the queue, or returns NULL right away if
+ * the queue is empty. Like queue_push(), this takes care of synchronization.
+ */
+void *queue_try_pop(queue_t *);
+
+/**
+ * Closes the queue, telling consumers blocked in queue_pop() that nothing more
+ * will be pushed.
+ */
+void queue_close(queue_t *);
+
+/**
+ * Tracks how many items to move per lock hold. The size grows while the queue
+ * is backed up, when batching costs no latency, and shrinks when the queue runs
+ * dry so that items are handed off as soon as they are ready.
+ */
+typedef struct batch {
+    size_t size;
+    size_t max;
+} batch_t;
+
+/**
+ * Starts a batch size at one item, allowing it to grow up to the given maximum.
+ */
+void batch_init(batch_t *, size_t);
+
+/**
+ * Adapts the batch size to the given queue depth: doubles it while more than a
+ * full batch is waiting, and halves it when the queue is empty.
+ */
+void batch_adapt(batch_t *, size_t);
+
 #endif
@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "ring.h"
+#include "stats.h"
+
+/**
+ * Creates a new, empty ring buffer with room for at least the given number of
+ * items. Returns NULL if memory allocation fails.
+ */
+ring_t *ring_create(size_t capacity) {
+    size_t i, size;
+    ring_t *ring;
+
+    size = 2;
+    while (size < capacity)
+        size <<= 1;
+
+    if (posix_memalign((void **) &ring, CACHELINE, sizeof(ring_t)) != 0)
+        return NULL;
+    if (posix_memalign((void **) &ring->slots, CACHELINE,
+                       size * sizeof(ring_slot_t)) != 0) {
+        free(ring);
+        return NULL;
+    }
+
+    // Slot i is free for the producer that claims position i
+    for (i = 0; i < size; i++) {
+        atomic_init(&ring->slots[i].sequence, i);
+        ring->slots[i].data = NULL;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->producers_waiting, 0);
+    atomic_init(&ring->consumers_waiting, 0);
+    atomic_init(&ring->closed, 0);
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->not_empty, NULL);
+    pthread_cond_init(&ring->not_full, NULL);
+    return ring;
+}
+
+/**
+ * Destroys the ring buffer. Any data still inside is not freed.
+ */
+void ring_destroy(ring_t *ring) {
+    if (ring) {
+        pthread_mutex_destroy(&ring->mutex);
+        pthread_cond_destroy(&ring->not_empty);
+        pthread_cond_destroy(&ring->not_full);
+        free(ring->slots);
+        free(ring);
+    }
+}
+
+/**
+ * Attempts to enqueue the given data. A producer claims a position by advancing
+ * the tail, writes its data, then publishes the slot by bumping its sequence.
+ */
+int ring_try_enqueue(ring_t *ring, void *data) {
+    ring_slot_t *slot;
+    size_t pos, seq;
+    long diff;
+
+    pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        diff = (long) seq - (long) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            // The consumers have not freed this slot yet
+            return 0;
+        }
+        else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->data = data;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * Attempts to dequeue the data at the front of the ring. A consumer claims a
+ * position by advancing the head, then hands the slot back to the producers one
+ * lap later.
+ */
+void *ring_try_dequeue(ring_t *ring) {
+    ring_slot_t *slot;
+    size_t pos, seq;
+    long diff;
+    void *data;
+
+    pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        diff = (long) seq - (long) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            // Nothing has been published here yet
+            return NULL;
+        }
+        else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    data = slot->data;
+    atomic_store_explicit(&slot->sequence, pos + ring->mask + 1,
+                          memory_order_release);
+    return data;
+}
+
+/**
+ * Wakes up one sleeper on the given condition if anyone is waiting on it. The
+ * fence pairs with the one in the sleeper: either the sleeper sees our update
+ * to the ring, or we see its waiting count and take the mutex to signal it.
+ */
+static void ring_wake(ring_t *ring, atomic_int *waiting, pthread_cond_t *cond) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) > 0) {
+        STATS_LOCK(&ring->mutex, STATS_QUEUE_LOCK);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+}
+
+/**
+ * Enqueues the given data, blocking while the ring is full. The mutex is only
+ * taken when the ring is full or a consumer is asleep.
+ */
+int ring_enqueue(ring_t *ring, void *data) {
+    int waits = 0;
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed))
+        return 0;
+    if (!ring_try_enqueue(ring, data)) {
+        STATS_LOCK(&ring->mutex, STATS_QUEUE_LOCK);
+        atomic_fetch_add(&ring->producers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!ring_try_enqueue(ring, data)) {
+            if (atomic_load(&ring->closed)) {
+                atomic_fetch_sub(&ring->producers_waiting, 1);
+                pthread_mutex_unlock(&ring->mutex);
+                return 0;
+            }
+            STATS_COND_WAIT(&ring->not_full, &ring->mutex, waits);
+        }
+        atomic_fetch_sub(&ring->producers_waiting, 1);
+        pthread_mutex_unlock(&ring->mutex);
+    }
+    ring_wake(ring, &ring->consumers_waiting, &ring->not_empty);
+    return 1;
+}
+
+/**
+ * Dequeues the data at the front of the ring, blocking while the ring is empty.
+ * The mutex is only taken when the ring is empty or a producer is asleep.
+ */
+void *ring_dequeue(ring_t *ring) {
+    void *data = ring_try_dequeue(ring);
+    int waits = 0;
+    if (!data) {
+        STATS_LOCK(&ring->mutex, STATS_QUEUE_LOCK);
+        atomic_fetch_add(&ring->consumers_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while ((data = ring_try_dequeue(ring)) == NULL) {
+            if (atomic_load(&ring->closed))
+                break;
+            STATS_COND_WAIT(&ring->not_empty, &ring->mutex, waits);
+        }
+        atomic_fetch_sub(&ring->consumers_waiting, 1);
+        pthread_mutex_unlock(&ring->mutex);
+        if (!data)
+            return NULL;
+    }
+    ring_wake(ring, &ring->producers_waiting, &ring->not_full);
+    return data;
+}
+
+/**
+ * Enqueues all of the given data in order. Items go in with the non-blocking
+ * call and only fall back to ring_enqueue() once the ring fills up. Consumers
+ * are woken before falling back: they may have gone to sleep before the items
+ * of this batch were published, and a full ring would never wake them.
+ */
+size_t ring_enqueue_batch(ring_t *ring, void **items, size_t count) {
+    size_t i;
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed))
+        return 0;
+    for (i = 0; i < count; i++) {
+        if (!ring_try_enqueue(ring, items[i])) {
+            ring_wake(ring, &ring->consumers_waiting, &ring->not_empty);
+            if (!ring_enqueue(ring, items[i]))
+                break;
+        }
+    }
+    ring_wake(ring, &ring->consumers_waiting, &ring->not_empty);
+    return i;
+}
+
+/**
+ * Dequeues up to the given number of items, sleeping only for the first one.
+ */
+size_t ring_dequeue_batch(ring_t *ring, void **items, size_t max) {
+    size_t count;
+    if (max == 0 || (items[0] = ring_dequeue(ring)) == NULL)
+        return 0;
+    for (count = 1; count < max; count++) {
+        if ((items[count] = ring_try_dequeue(ring)) == NULL)
+            break;
+    }
+    if (count > 1)
+        ring_wake(ring, &ring->producers_waiting, &ring->not_full);
+    return count;
+}
+
+/**
+ * Closes the ring and wakes up every blocked caller.
+ */
+void ring_close(ring_t *ring) {
+    STATS_LOCK(&ring->mutex, STATS_QUEUE_LOCK);
+    atomic_store(&ring->closed, 1);
+    pthread_cond_broadcast(&ring->not_empty);
+    pthread_cond_broadcast(&ring->not_full);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/**
+ * Returns the number of items in the ring.
+ */
+size_t ring_size(ring_t *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+/**
+ * Peeks at the front of the ring without dequeueing it.
+ */
+const void *ring_peek(ring_t *ring) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_slot_t *slot = &ring->slots[pos & ring->mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) == pos + 1)
+        return slot->data;
+    return NULL;
+}
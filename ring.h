@@ -0,0 +1,107 @@
+#ifndef RING_H
+#define RING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define CACHELINE 64
+
+/**
+ * A single slot in the ring buffer. The sequence number tells producers and
+ * consumers whose turn it is to use the slot.
+ */
+typedef struct ring_slot {
+    atomic_size_t sequence;
+    void *data;
+} ring_slot_t;
+
+/**
+ * Type for a fixed-capacity, lock-free, multi-producer multi-consumer ring
+ * buffer. The head and tail counters live on their own cache lines so that
+ * producers and consumers do not false-share. The mutex and conditions are only
+ * used by the blocking calls to sleep when the ring is full or empty; the try
+ * calls never touch them.
+ */
+typedef struct ring {
+    _Alignas(CACHELINE) atomic_size_t tail;
+    _Alignas(CACHELINE) atomic_size_t head;
+    _Alignas(CACHELINE) ring_slot_t *slots;
+    size_t mask;
+    atomic_int producers_waiting;
+    atomic_int consumers_waiting;
+    atomic_int closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ring_t;
+
+/**
+ * Creates a new, empty ring buffer. The capacity is rounded up to the next
+ * power of two.
+ */
+ring_t *ring_create(size_t);
+
+/**
+ * Destroys the ring buffer. Any data still inside is not freed.
+ */
+void ring_destroy(ring_t *);
+
+/**
+ * Attempts to enqueue the given data. Returns 1 on success, or 0 if the ring is
+ * full. The data must not be NULL. This is a non-blocking function.
+ */
+int ring_try_enqueue(ring_t *, void *);
+
+/**
+ * Attempts to dequeue the data at the front of the ring. Returns NULL if the
+ * ring is empty. This is a non-blocking function.
+ */
+void *ring_try_dequeue(ring_t *);
+
+/**
+ * Enqueues the given data, blocking while the ring is full. Returns 1 on
+ * success, or 0 if the ring is closed or was closed before there was room.
+ */
+int ring_enqueue(ring_t *, void *);
+
+/**
+ * Dequeues the data at the front of the ring, blocking while the ring is empty.
+ * Returns NULL once the ring has been closed and drained.
+ */
+void *ring_dequeue(ring_t *);
+
+/**
+ * Enqueues all of the given data in order, blocking while the ring is full.
+ * Sleeping consumers are woken once for the whole batch rather than once per
+ * item. Returns the number of items enqueued, which is less than requested
+ * only if the ring is or was closed.
+ */
+size_t ring_enqueue_batch(ring_t *, void **, size_t);
+
+/**
+ * Dequeues up to the given number of items, blocking until at least one is
+ * available. Returns the number of items dequeued, or zero once the ring has
+ * been closed and drained.
+ */
+size_t ring_dequeue_batch(ring_t *, void **, size_t);
+
+/**
+ * Closes the ring and wakes up every blocked caller. Data already in the ring
+ * can still be dequeued, but nothing more is enqueued.
+ */
+void ring_close(ring_t *);
+
+/**
+ * Returns the number of items in the ring. This is only a snapshot when other
+ * threads are using the ring.
+ */
+size_t ring_size(ring_t *);
+
+/**
+ * Peeks at the front of the ring without dequeueing it, or returns NULL if the
+ * ring is empty. The result is only stable if the caller is the only consumer.
+ */
+const void *ring_peek(ring_t *);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "books.h"
+#include "queue.h"
+#include "router.h"
+
+/**
+ * Creates a new router with one empty queue for each of the given categories.
+ * Returns NULL if memory allocation fails.
+ */
+router_t *router_create(char **categories, int num_categories,
+                        size_t capacity) {
+    int i;
+    router_t *router = (router_t *) malloc(sizeof(router_t));
+    if (!router)
+        return NULL;
+
+    router->num_categories = num_categories;
+    router->categories = category_table_create();
+    router->queues = (queue_t **) calloc(num_categories, sizeof(queue_t *));
+    router->pending = (order_t ***) calloc(num_categories, sizeof(order_t **));
+    router->num_pending = (size_t *) calloc(num_categories, sizeof(size_t));
+    router->batch = (batch_t *) calloc(num_categories, sizeof(batch_t));
+    if (!router->categories || !router->queues || !router->pending
+            || !router->num_pending || !router->batch) {
+        router_destroy(router);
+        return NULL;
+    }
+
+    for (i = 0; i < num_categories; i++) {
+        router->queues[i] = capacity ? queue_create_ring(capacity)
+                                     : queue_create();
+        router->pending[i] = (order_t **) malloc(MAXBATCH * sizeof(order_t *));
+        if (category_table_add(router->categories, categories[i],
+                               strlen(categories[i])) < 0
+                || !router->queues[i] || !router->pending[i]) {
+            router_destroy(router);
+            return NULL;
+        }
+        batch_init(&router->batch[i], MAXBATCH);
+    }
+    return router;
+}
+
+/**
+ * Destroys the router and all of its queues. Any orders still sitting in the
+ * queues are destroyed as well.
+ */
+void router_destroy(router_t *router) {
+    int i;
+    if (router) {
+        for (i = 0; i < router->num_categories; i++) {
+            if (router->queues)
+                queue_destroy(router->queues[i], (void (*)(void *)) &order_destroy);
+            if (router->pending)
+                free(router->pending[i]);
+        }
+        category_table_destroy(router->categories);
+        free(router->queues);
+        free(router->pending);
+        free(router->num_pending);
+        free(router->batch);
+        free(router);
+    }
+}
+
+/**
+ * Returns the index of the queue for the given category, or -1 if the category
+ * is not handled by this router.
+ */
+int router_lookup(router_t *router, const char *category, size_t length) {
+    return category_table_find(router->categories, category, length);
+}
+
+/**
+ * Hands the orders pending for the given category over to its queue in one
+ * batch, adapting the batch size to how deep the queue was. Orders the queue
+ * does not take are reported and destroyed.
+ */
+static void router_flush_category(router_t *router, int index) {
+    queue_t *queue = router->queues[index];
+    size_t i, taken;
+    if (router->num_pending[index] == 0)
+        return;
+    batch_adapt(&router->batch[index], queue_size(queue));
+    taken = queue_enqueue_batch(queue, (void **) router->pending[index],
+                                router->num_pending[index]);
+    if (taken < router->num_pending[index]) {
+        fprintf(stderr, "Error: the queue for category %d did not take %zu "
+                "orders.\n", index, router->num_pending[index] - taken);
+        for (i = taken; i < router->num_pending[index]; i++) {
+            order_destroy(router->pending[index][i]);
+        }
+    }
+    router->num_pending[index] = 0;
+}
+
+/**
+ * Places the order into the pending batch for its category. The batch is handed
+ * over once it is full, or right away if the consumer has less than a batch of
+ * work left, so batching never starves an idle consumer.
+ */
+int router_enqueue(router_t *router, order_t *order) {
+    int index = order->category_id;
+    if (index < 0) {
+        index = router_lookup(router, order->category,
+                              order->category_length);
+        if (index < 0)
+            return -1;
+        order->category_id = index;
+    }
+
+    router->pending[index][router->num_pending[index]++] = order;
+    if (router->num_pending[index] >= router->batch[index].size
+            || queue_size(router->queues[index]) < router->batch[index].size)
+        router_flush_category(router, index);
+    return 0;
+}
+
+/**
+ * Hands every order still pending in the producer over to its queue.
+ */
+void router_flush(router_t *router) {
+    int i;
+    for (i = 0; i < router->num_categories; i++) {
+        router_flush_category(router, i);
+    }
+}
+
+/**
+ * Removes the next order from the queue with the given index, sleeping until an
+ * order is available. Returns NULL once the router is done and the queue has
+ * been drained.
+ */
+order_t *router_dequeue(router_t *router, int index) {
+    return (order_t *) queue_pop(router->queues[index]);
+}
+
+/**
+ * Removes up to the given number of orders from the queue with the given index
+ * under a single hold of that queue's mutex.
+ */
+size_t router_dequeue_batch(router_t *router, int index, order_t **orders,
+                            size_t max) {
+    return queue_dequeue_batch(router->queues[index], (void **) orders, max);
+}
+
+/**
+ * Tells the consumers that no more orders will be produced by flushing the
+ * pending orders and closing every category queue.
+ */
+void router_finish(router_t *router) {
+    int i;
+    router_flush(router);
+    for (i = 0; i < router->num_categories; i++) {
+        queue_close(router->queues[i]);
+    }
+}
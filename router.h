@@ -0,0 +1,85 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "books.h"
+#include "category.h"
+#include "queue.h"
+
+/**
+ * Routes book orders to a queue owned by their category. Every category has its
+ * own queue, and therefore its own mutex and nonempty condition, so a consumer
+ * only ever wakes up for orders in its own category and one slow category
+ * cannot hold up the others. Orders within a category stay in FIFO order. A
+ * category's queue is found by its ID in the router's category table.
+ */
+typedef struct router {
+    category_table_t *categories;
+    queue_t **queues;
+    int num_categories;
+    // Orders the producer has routed but not yet handed to each queue
+    order_t ***pending;
+    size_t *num_pending;
+    batch_t *batch;
+} router_t;
+
+/**
+ * The most orders moved into or out of a category queue per lock hold.
+ */
+#define MAXBATCH 64
+
+/**
+ * Creates a new router with one empty queue for each of the given categories.
+ * If the capacity is zero the queues are unbounded linked lists; otherwise they
+ * are lock-free ring buffers holding at most that many orders each.
+ */
+router_t *router_create(char **, int, size_t);
+
+/**
+ * Destroys the router and all of its queues. Do not call this method while
+ * producers or consumers are still using the router.
+ */
+void router_destroy(router_t *);
+
+/**
+ * Returns the index of the queue for the category with the given name and
+ * length, or -1 if the category is not handled by this router.
+ */
+int router_lookup(router_t *, const char *, size_t);
+
+/**
+ * Places the order into the queue for its category and wakes up the consumer
+ * for that category. An order whose category ID is set must have been given it
+ * by router_lookup(); otherwise its category is looked up by name. Orders are handed over in batches whose size adapts to how
+ * far behind the consumer is; while the consumer is keeping up, every order is
+ * handed over right away. Returns 0 on success, or -1 if the order's category
+ * is not handled by this router. Only one thread may enqueue at a time.
+ */
+int router_enqueue(router_t *, order_t *);
+
+/**
+ * Hands every order still pending in the producer over to its queue.
+ */
+void router_flush(router_t *);
+
+/**
+ * Removes the next order from the queue with the given index, blocking until an
+ * order is available. Returns NULL once the router is done and the queue has
+ * been drained.
+ */
+order_t *router_dequeue(router_t *, int);
+
+/**
+ * Removes up to the given number of orders from the queue with the given index,
+ * blocking until at least one is available. Returns the number of orders
+ * removed, or zero once the router is done and the queue has been drained.
+ */
+size_t router_dequeue_batch(router_t *, int, order_t **, size_t);
+
+/**
+ * Tells the consumers that no more orders will be produced and wakes all of
+ * them up so that they can drain their queues and exit. Any pending orders are
+ * flushed first.
+ */
+void router_finish(router_t *);
+
+#endif
@@ -0,0 +1,267 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+/**
+ * Classifies one block of SCAN_BLOCK bytes: bit i of each mask is set if byte
+ * i is a delimiter ('|' or '\r'), a double quote or a newline.
+ */
+typedef void (*scan_masks_t)(const char *, uint64_t *, uint64_t *,
+                             uint64_t *);
+
+/**
+ * The implementation in use, and its name.
+ */
+static scan_masks_t scan_masks;
+static const char *scan_name;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Returns a byte mask of the bytes of the word equal to the given byte
+ * repeated eight times: the high bit of each such byte is set, and no other.
+ */
+static inline uint64_t scan_swar_equal(uint64_t word, uint64_t pattern) {
+    const uint64_t low = 0x7F7F7F7F7F7F7F7FULL;
+    uint64_t x = word ^ pattern;
+    return ~(((x & low) + low) | x | low);
+}
+
+/**
+ * Packs the high bits of the eight bytes of a byte mask into eight bits, byte
+ * i going to bit i.
+ */
+static inline uint64_t scan_swar_pack(uint64_t mask) {
+    return ((mask >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+/**
+ * Classifies a block without vector instructions. On a little-endian machine
+ * eight bytes are compared at a time in a 64-bit word; otherwise one at a
+ * time.
+ */
+static void scan_masks_scalar(const char *block, uint64_t *delimiters,
+                              uint64_t *quotes, uint64_t *newlines) {
+    uint64_t d = 0, q = 0, n = 0;
+    int i;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t word;
+
+    for (i = 0; i < SCAN_BLOCK; i += 8) {
+        memcpy(&word, block + i, sizeof(word));
+        d |= scan_swar_pack(scan_swar_equal(word, '|' * ones)
+                            | scan_swar_equal(word, '\r' * ones)) << i;
+        q |= scan_swar_pack(scan_swar_equal(word, '"' * ones)) << i;
+        n |= scan_swar_pack(scan_swar_equal(word, '\n' * ones)) << i;
+    }
+#else
+    for (i = 0; i < SCAN_BLOCK; i++) {
+        d |= (uint64_t) (block[i] == '|' || block[i] == '\r') << i;
+        q |= (uint64_t) (block[i] == '"') << i;
+        n |= (uint64_t) (block[i] == '\n') << i;
+    }
+#endif
+    *delimiters = d;
+    *quotes = q;
+    *newlines = n;
+}
+
+#ifdef SCAN_X86
+/**
+ * Classifies a block sixteen bytes at a time.
+ */
+__attribute__((target("sse2")))
+static void scan_masks_sse2(const char *block, uint64_t *delimiters,
+                            uint64_t *quotes, uint64_t *newlines) {
+    const __m128i bar = _mm_set1_epi8('|'), cr = _mm_set1_epi8('\r');
+    const __m128i quote = _mm_set1_epi8('"'), nl = _mm_set1_epi8('\n');
+    uint64_t d = 0, q = 0, n = 0;
+    __m128i v;
+    int i;
+
+    for (i = 0; i < SCAN_BLOCK; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (block + i));
+        d |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(v, bar),
+                             _mm_cmpeq_epi8(v, cr))) << i;
+        q |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, quote)) << i;
+        n |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, nl)) << i;
+    }
+    *delimiters = d;
+    *quotes = q;
+    *newlines = n;
+}
+
+/**
+ * Classifies a block thirty-two bytes at a time.
+ */
+__attribute__((target("avx2")))
+static void scan_masks_avx2(const char *block, uint64_t *delimiters,
+                            uint64_t *quotes, uint64_t *newlines) {
+    const __m256i bar = _mm256_set1_epi8('|'), cr = _mm256_set1_epi8('\r');
+    const __m256i quote = _mm256_set1_epi8('"'), nl = _mm256_set1_epi8('\n');
+    uint64_t d = 0, q = 0, n = 0;
+    __m256i v;
+    int i;
+
+    for (i = 0; i < SCAN_BLOCK; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (block + i));
+        d |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, bar),
+                                _mm256_cmpeq_epi8(v, cr))) << i;
+        q |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(v, quote)) << i;
+        n |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(v, nl)) << i;
+    }
+    *delimiters = d;
+    *quotes = q;
+    *newlines = n;
+}
+#endif
+
+/**
+ * Picks the widest implementation the processor supports, unless SCAN_ISA asks
+ * for a narrower one.
+ */
+static void scan_select(void) {
+    const char *isa = getenv("SCAN_ISA");
+
+    scan_masks = scan_masks_scalar;
+    scan_name = "scalar";
+    if (isa && strcmp(isa, "scalar") == 0)
+        return;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        scan_masks = scan_masks_sse2;
+        scan_name = "sse2";
+    }
+    if (isa && strcmp(isa, "sse2") == 0)
+        return;
+    if (__builtin_cpu_supports("avx2")) {
+        scan_masks = scan_masks_avx2;
+        scan_name = "avx2";
+    }
+#endif
+}
+
+/**
+ * Returns the name of the implementation in use.
+ */
+const char *scan_implementation(void) {
+    pthread_once(&scan_once, scan_select);
+    return scan_name;
+}
+
+/**
+ * Records the field between the two offsets into the line, unless it is empty
+ * or the line already has all the fields it can hold.
+ */
+static void scan_field(scan_line_t *line, size_t start, size_t end) {
+    if (end > start && line->num_fields < SCAN_MAXFIELDS) {
+        line->field[line->num_fields] = start - line->start;
+        line->field_end[line->num_fields] = end - line->start;
+        line->num_fields++;
+    }
+}
+
+/**
+ * Splits a line with an unclosed quote again, this time ignoring quotes.
+ */
+static void scan_line_plain(const char *data, scan_line_t *line, size_t end) {
+    size_t p, start = line->start;
+
+    line->num_fields = 0;
+    for (p = line->start; p < end; p++) {
+        if (data[p] == '|' || data[p] == '\r') {
+            scan_field(line, start, p);
+            start = p + 1;
+        }
+    }
+    scan_field(line, start, end);
+}
+
+/**
+ * Splits lines into fields. A whole block is classified at once, then its set
+ * bits are visited in order; bytes that are none of the three are never
+ * looked at again. The last, partial block is copied into a zeroed buffer.
+ */
+size_t scan_lines(const char *data, size_t length, scan_line_t *lines,
+                  size_t max) {
+    char tail[SCAN_BLOCK];
+    uint64_t delimiters, quotes, newlines, events;
+    size_t base, position, field_start, count;
+    scan_line_t *line;
+    int in_quote;
+
+    pthread_once(&scan_once, scan_select);
+    if (max == 0 || length == 0)
+        return 0;
+
+    count = 0;
+    line = &lines[0];
+    line->start = 0;
+    line->num_fields = 0;
+    field_start = 0;
+    in_quote = 0;
+    for (base = 0; base < length; base += SCAN_BLOCK) {
+        if (length - base >= SCAN_BLOCK) {
+            scan_masks(data + base, &delimiters, &quotes, &newlines);
+        }
+        else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, data + base, length - base);
+            scan_masks(tail, &delimiters, &quotes, &newlines);
+        }
+
+        for (events = delimiters | quotes | newlines; events;
+             events &= events - 1) {
+            position = base + __builtin_ctzll(events);
+            if (newlines & (events & -events)) {
+                if (in_quote)
+                    scan_line_plain(data, line, position);
+                else
+                    scan_field(line, field_start, position);
+                line->next = position + 1;
+                if (++count == max)
+                    return count;
+                line = &lines[count];
+                line->start = position + 1;
+                line->num_fields = 0;
+                field_start = position + 1;
+                in_quote = 0;
+            }
+            else if (quotes & (events & -events)) {
+                if (in_quote)
+                    in_quote = 0;
+                else if (position == field_start)
+                    in_quote = 1;
+            }
+            else if (!in_quote) {
+                scan_field(line, field_start, position);
+                field_start = position + 1;
+            }
+        }
+    }
+
+    // The last line has no newline
+    if (line->start < length) {
+        if (in_quote)
+            scan_line_plain(data, line, length);
+        else
+            scan_field(line, field_start, length);
+        line->next = length;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,52 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The most fields recorded for one line. Any further fields are ignored.
+ */
+#define SCAN_MAXFIELDS 8
+
+/**
+ * The number of bytes classified at a time.
+ */
+#define SCAN_BLOCK 64
+
+/**
+ * A line found by the scanner. The start of the line and the start of the next
+ * one are offsets into the scanned data; the fields are offsets into the line.
+ * Fields are separated by '|' and, as with strtok, empty fields and carriage
+ * returns are skipped. A field that starts with a double quote runs to the
+ * closing quote, so a title may contain a '|'; if the quote is never closed on
+ * the line, the quotes are ignored.
+ */
+typedef struct scan_line {
+    size_t start;
+    size_t next;
+    int num_fields;
+    uint32_t field[SCAN_MAXFIELDS];
+    uint32_t field_end[SCAN_MAXFIELDS];
+} scan_line_t;
+
+/**
+ * Splits up to the given number of lines at the start of the data into their
+ * fields, in one pass. A line ends at a newline, which is not part of it, or
+ * at the end of the data. Returns the number of lines found; the last line's
+ * next offset tells how much of the data was consumed.
+ *
+ * The data is classified a block of SCAN_BLOCK bytes at a time into bit masks
+ * of its delimiters, quotes and newlines, with AVX2 or SSE2 when the processor
+ * has them and byte by byte otherwise, and only the set bits are visited. The
+ * implementation is picked on first use; the SCAN_ISA environment variable may
+ * name a narrower one ("sse2" or "scalar").
+ */
+size_t scan_lines(const char *, size_t, scan_line_t *, size_t);
+
+/**
+ * Returns the name of the implementation scan_lines() uses.
+ */
+const char *scan_implementation(void);
+
+#endif
@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "books.h"
+#include "queue.h"
+#include "shard.h"
+#include "stats.h"
+
+/**
+ * Code for the shard threads. Orders are taken off the shard's queue a batch at
+ * a time; the flush function is called whenever the queue has run dry, just
+ * before the thread sleeps waiting for more.
+ */
+static void *shard_thread(void *args) {
+    shard_t *shard = (shard_t *) args;
+    shards_t *set = shard->set;
+    order_t *orders[SHARDBATCH];
+    size_t count, i;
+
+    STATS_THREAD("shard", shard->index);
+    for (;;) {
+        if (set->flush_hook && queue_size(shard->orders) == 0)
+            set->flush_hook(shard->index);
+        if ((count = queue_dequeue_batch(shard->orders, (void **) orders,
+                                         SHARDBATCH)) == 0)
+            break;
+        for (i = 0; i < count; i++) {
+            STATS_STAMP(orders[i], STAGE_DEQUEUED);
+            set->process(orders[i], shard->index);
+        }
+        shard->applied += count;
+    }
+    return NULL;
+}
+
+/**
+ * Creates the shards and starts their threads. Returns NULL if allocation
+ * fails.
+ */
+shards_t *shards_create(int num_shards, pool_process_t process,
+                        pool_flush_t flush_hook, size_t capacity) {
+    shard_t *shard;
+    int i;
+    shards_t *set = (shards_t *) malloc(sizeof(shards_t));
+    if (!set)
+        return NULL;
+
+    set->shards = (shard_t *) calloc(num_shards, sizeof(shard_t));
+    if (!set->shards) {
+        free(set);
+        return NULL;
+    }
+    set->num_shards = num_shards;
+    set->process = process;
+    set->flush_hook = flush_hook;
+
+    for (i = 0; i < num_shards; i++) {
+        shard = &set->shards[i];
+        shard->index = i;
+        shard->set = set;
+        shard->orders = capacity ? queue_create_ring(capacity)
+                                 : queue_create();
+        shard->pending = (order_t **) malloc(SHARDBATCH * sizeof(order_t *));
+        if (!shard->orders || !shard->pending) {
+            set->num_shards = i + 1;
+            shards_destroy(set);
+            return NULL;
+        }
+        batch_init(&shard->batch, SHARDBATCH);
+    }
+    for (i = 0; i < num_shards; i++) {
+        pthread_create(&set->shards[i].thread, NULL, shard_thread,
+                       &set->shards[i]);
+    }
+    return set;
+}
+
+/**
+ * Returns the index of the shard that owns the customer with the given ID.
+ */
+int shards_owner(shards_t *set, long customer_id) {
+    return (int) ((unsigned long) customer_id % set->num_shards);
+}
+
+/**
+ * Hands the orders pending for the shard over to its queue in one batch,
+ * adapting the batch size to how deep the queue was. Orders the queue does not
+ * take are reported and destroyed.
+ */
+static void shard_flush(shard_t *shard) {
+    size_t i, taken;
+    if (shard->num_pending == 0)
+        return;
+    batch_adapt(&shard->batch, queue_size(shard->orders));
+    taken = queue_enqueue_batch(shard->orders, (void **) shard->pending,
+                                shard->num_pending);
+    if (taken < shard->num_pending) {
+        fprintf(stderr, "Error: shard %d did not take %zu orders.\n",
+                shard->index, shard->num_pending - taken);
+        for (i = taken; i < shard->num_pending; i++) {
+            order_destroy(shard->pending[i]);
+        }
+    }
+    shard->num_pending = 0;
+}
+
+/**
+ * Places the order into the pending batch for its customer's shard. As with
+ * the router, the batch is handed over once it is full, or right away if the
+ * shard has less than a batch of work left.
+ */
+void shards_submit(shards_t *set, order_t *order) {
+    shard_t *shard = &set->shards[shards_owner(set, order->customer_id)];
+
+    STATS_STAMP(order, STAGE_ENQUEUED);
+    shard->pending[shard->num_pending++] = order;
+    if (shard->num_pending >= shard->batch.size
+            || queue_size(shard->orders) < shard->batch.size)
+        shard_flush(shard);
+}
+
+/**
+ * Flushes the pending orders, closes every shard's queue and waits for the
+ * shard threads to drain them.
+ */
+void shards_finish(shards_t *set) {
+    int i;
+    for (i = 0; i < set->num_shards; i++) {
+        shard_flush(&set->shards[i]);
+        queue_close(set->shards[i].orders);
+    }
+    for (i = 0; i < set->num_shards; i++) {
+        pthread_join(set->shards[i].thread, NULL);
+    }
+}
+
+/**
+ * Destroys the shards and any orders left in their queues.
+ */
+void shards_destroy(shards_t *set) {
+    int i;
+    if (set) {
+        for (i = 0; i < set->num_shards; i++) {
+            queue_destroy(set->shards[i].orders,
+                          (void (*)(void *)) &order_destroy);
+            free(set->shards[i].pending);
+        }
+        free(set->shards);
+        free(set);
+    }
+}
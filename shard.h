@@ -0,0 +1,84 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+
+#include "books.h"
+#include "pool.h"
+#include "queue.h"
+
+/**
+ * The most orders the producer hands to a shard's queue at once.
+ */
+#define SHARDBATCH 64
+
+struct shards;
+
+/**
+ * A shard thread and the queue of orders for the customers it owns.
+ */
+typedef struct shard {
+    int index;
+    struct shards *set;
+    queue_t *orders;
+    pthread_t thread;
+    long applied;
+    // Orders the producer has routed but not yet handed to the queue
+    order_t **pending;
+    size_t num_pending;
+    batch_t batch;
+} shard_t;
+
+/**
+ * A fixed set of shard threads that partition the customers between them: the
+ * customer with a given ID belongs to shard ID % N. Every order for a customer
+ * goes to the queue of the customer's shard, and only that shard's thread ever
+ * touches the customer's balance and receipts, so they need no lock at all
+ * while the shards run. Each customer's orders are applied in the order they
+ * were submitted.
+ *
+ * Unlike the worker pool, a shard cannot help out another one; a customer that
+ * gets most of the orders keeps its shard busy while the others wait. The
+ * queues are bounded when a capacity is given, so a shard that falls behind
+ * holds back the producer.
+ */
+typedef struct shards {
+    shard_t *shards;
+    int num_shards;
+    pool_process_t process;
+    pool_flush_t flush_hook;
+} shards_t;
+
+/**
+ * Creates the given number of shards and starts their threads. The process
+ * and flush functions are called with the shard's index, as the pool calls
+ * them with the worker's; since no other thread ever applies a shard's
+ * customers, a shard only flushes when its queue runs dry. If the capacity is
+ * zero the queues are unbounded; otherwise each holds at most about that many
+ * orders. Returns NULL if memory allocation fails.
+ */
+shards_t *shards_create(int, pool_process_t, pool_flush_t, size_t);
+
+/**
+ * Returns the index of the shard that owns the customer with the given ID.
+ */
+int shards_owner(shards_t *, long);
+
+/**
+ * Submits an order to the shard that owns its customer. Only one thread may
+ * submit orders.
+ */
+void shards_submit(shards_t *, order_t *);
+
+/**
+ * Hands over every pending order, tells the shards no more will be submitted,
+ * then waits for them to apply every order and exit.
+ */
+void shards_finish(shards_t *);
+
+/**
+ * Destroys the shards. Call shards_finish() first.
+ */
+void shards_destroy(shards_t *);
+
+#endif
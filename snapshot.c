@@ -0,0 +1,244 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "books.h"
+#include "snapshot.h"
+
+/**
+ * Rounds the offset up to the next section boundary.
+ */
+static uint64_t snapshot_align(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t) (SNAPSHOT_ALIGN - 1);
+}
+
+/**
+ * Writes zeros to the file until it reaches the given offset.
+ */
+static int snapshot_pad(FILE *file, uint64_t offset) {
+    while ((uint64_t) ftell(file) < offset) {
+        if (fputc('\0', file) == EOF)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the database to a temporary file next to the path, then renames it
+ * into place.
+ */
+int snapshot_write(database_t *database, const char *path) {
+    snapshot_header_t header;
+    snapshot_record_t record;
+    customer_t *customer;
+    char *temp;
+    FILE *file;
+    size_t i;
+    int failed, saved;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(snapshot_header_t);
+    header.record_size = sizeof(snapshot_record_t);
+    header.slot_size = sizeof(database_slot_t);
+    header.num_customers = database->num_customers;
+    header.capacity = database->capacity;
+    header.records_offset = snapshot_align(sizeof(snapshot_header_t));
+    header.slots_offset = snapshot_align(header.records_offset
+            + header.num_customers * sizeof(snapshot_record_t));
+    header.strings_offset = snapshot_align(header.slots_offset
+            + header.capacity * sizeof(database_slot_t));
+    for (i = 0; i < database->num_customers; i++) {
+        header.strings_length += strlen(database_customer(database, i)->name)
+                                 + 1;
+    }
+
+    if ((temp = (char *) malloc(strlen(path) + 5)) == NULL)
+        return -1;
+    sprintf(temp, "%s.tmp", path);
+    if ((file = fopen(temp, "wb")) == NULL) {
+        saved = errno;
+        free(temp);
+        errno = saved;
+        return -1;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    snapshot_pad(file, header.records_offset);
+    memset(&record, 0, sizeof(record));
+    for (i = 0; i < database->num_customers; i++) {
+        customer = database_customer(database, i);
+        record.customer_id = customer->customer_id;
+        record.name_length = strlen(customer->name);
+        record.credit_limit = customer->credit_limit;
+        fwrite(&record, sizeof(record), 1, file);
+        record.name_offset += record.name_length + 1;
+    }
+    snapshot_pad(file, header.slots_offset);
+    fwrite(database->slots, sizeof(database_slot_t), database->capacity, file);
+    snapshot_pad(file, header.strings_offset);
+    for (i = 0; i < database->num_customers; i++) {
+        customer = database_customer(database, i);
+        fwrite(customer->name, 1, strlen(customer->name) + 1, file);
+    }
+
+    failed = ferror(file);
+    if (fclose(file) != 0 || failed || rename(temp, path) != 0) {
+        saved = errno;
+        unlink(temp);
+        free(temp);
+        errno = saved;
+        return -1;
+    }
+    free(temp);
+    return 0;
+}
+
+/**
+ * Returns nonzero if the header describes a snapshot this build can read, and
+ * every section fits inside a file of the given length.
+ */
+static int snapshot_valid(const snapshot_header_t *header, size_t length) {
+    if (length < sizeof(snapshot_header_t)
+            || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SNAPSHOT_VERSION
+            || header->header_size != sizeof(snapshot_header_t)
+            || header->record_size != sizeof(snapshot_record_t)
+            || header->slot_size != sizeof(database_slot_t))
+        return 0;
+    if (header->capacity == 0 || (header->capacity & (header->capacity - 1))
+            || header->num_customers >= header->capacity
+            || header->capacity > length / sizeof(database_slot_t)
+            || header->records_offset > length
+            || header->slots_offset > length
+            || header->strings_offset > length
+            || header->strings_length > length
+            || (header->records_offset | header->slots_offset)
+               % sizeof(uint64_t) != 0)
+        return 0;
+    return header->records_offset + header->num_customers
+                   * sizeof(snapshot_record_t) <= header->slots_offset
+        && header->slots_offset + header->capacity
+                   * sizeof(database_slot_t) <= header->strings_offset
+        && header->strings_offset + header->strings_length <= length
+        && (header->strings_length == 0
+            || ((const char *) header)[header->strings_offset
+                                       + header->strings_length - 1] == '\0');
+}
+
+/**
+ * Returns nonzero if every slot of the hash table points at a record holding
+ * the slot's customer ID, exactly one slot per customer is in use, and every
+ * record's name lies inside the string table and ends with its terminator. The
+ * header must already be valid. Probing can then neither leave the mapping nor
+ * run forever on a full table.
+ */
+static int snapshot_valid_tables(const snapshot_header_t *header) {
+    const char *base = (const char *) header;
+    const database_slot_t *slots;
+    const snapshot_record_t *records;
+    const char *strings;
+    uint64_t i, used;
+
+    slots = (const database_slot_t *) (base + header->slots_offset);
+    records = (const snapshot_record_t *) (base + header->records_offset);
+    strings = base + header->strings_offset;
+    used = 0;
+    for (i = 0; i < header->capacity; i++) {
+        if (slots[i].position == 0)
+            continue;
+        if (slots[i].position > header->num_customers
+                || records[slots[i].position - 1].customer_id
+                   != slots[i].customer_id)
+            return 0;
+        used++;
+    }
+    if (used != header->num_customers)
+        return 0;
+    for (i = 0; i < header->num_customers; i++) {
+        if (records[i].name_offset >= header->strings_length
+                || records[i].name_length
+                   >= header->strings_length - records[i].name_offset
+                || strings[records[i].name_offset + records[i].name_length]
+                   != '\0')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Maps the snapshot read-only and wraps a database around it. The hash table
+ * is probed straight out of the mapping; the customers array is allocated
+ * zeroed, which costs nothing until each customer is loaded into it. The
+ * table and records are checked once, with a sequential pass over them, so
+ * that a corrupt snapshot is rejected instead of read out of bounds.
+ */
+database_t *snapshot_open(const char *path) {
+    const snapshot_header_t *header;
+    database_t *database;
+    struct stat info;
+    void *mapping;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    header = (const snapshot_header_t *) mapping;
+    if (!snapshot_valid(header, info.st_size)
+            || !snapshot_valid_tables(header)
+            || (database = database_create(0)) == NULL) {
+        munmap(mapping, info.st_size);
+        return NULL;
+    }
+
+    free(database->slots);
+    free(database->customers);
+    database->mapping = mapping;
+    database->mapping_length = info.st_size;
+    database->slots = (database_slot_t *) ((char *) mapping
+                                           + header->slots_offset);
+    database->capacity = header->capacity;
+    database->records = (const snapshot_record_t *) ((char *) mapping
+                                                     + header->records_offset);
+    database->strings = (const char *) mapping + header->strings_offset;
+    database->num_customers = header->num_customers;
+    database->max_customers = header->num_customers;
+    database->customers = (customer_t *) calloc(header->num_customers + 1,
+                                                sizeof(customer_t));
+    if (!database->customers) {
+        database_destroy(database);
+        return NULL;
+    }
+    return database;
+}
+
+/**
+ * Returns nonzero if the file at the given path starts with the snapshot
+ * magic number.
+ */
+int snapshot_check(const char *path) {
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    FILE *file;
+    int match;
+
+    if ((file = fopen(path, "rb")) == NULL)
+        return 0;
+    match = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+            && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
@@ -0,0 +1,81 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "books.h"
+
+/**
+ * The first bytes of every database snapshot. The line break catches files
+ * that were mangled by a text-mode transfer.
+ */
+#define SNAPSHOT_MAGIC "BOOKDB\r\n"
+
+/**
+ * The snapshot format version. Bump it whenever the layout of the header, the
+ * records or the hash slots changes.
+ */
+#define SNAPSHOT_VERSION 2
+
+/**
+ * Sections of a snapshot start on a multiple of this many bytes.
+ */
+#define SNAPSHOT_ALIGN 64
+
+/**
+ * The header at the start of a snapshot. Sections are located by their
+ * offsets from the start of the file, and the sizes of the records and slots
+ * are stored so that a snapshot written by an incompatible build is rejected
+ * instead of misread.
+ *
+ * A snapshot is laid out as the header, one record per customer in file
+ * order, the database's hash table ready to be probed in place, and a string
+ * table holding every customer's name, null-terminated.
+ */
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t slot_size;
+    uint64_t num_customers;
+    uint64_t capacity;
+    uint64_t records_offset;
+    uint64_t slots_offset;
+    uint64_t strings_offset;
+    uint64_t strings_length;
+} snapshot_header_t;
+
+/**
+ * A fixed-size customer record. The name is an offset into the string table,
+ * and the credit limit is in cents.
+ */
+typedef struct snapshot_record {
+    int64_t customer_id;
+    uint64_t name_offset;
+    int64_t credit_limit;
+    uint32_t name_length;
+    uint32_t reserved;
+} snapshot_record_t;
+
+/**
+ * Writes the database to a snapshot at the given path. The snapshot is written
+ * next to the path and renamed into place, so a reader never sees half of one.
+ * Returns 0 on success, or -1 on failure with errno set.
+ */
+int snapshot_write(database_t *, const char *);
+
+/**
+ * Maps the snapshot at the given path read-only and returns a database backed
+ * by it, or NULL if the file cannot be mapped or is not a valid snapshot. The
+ * customers are copied out of the mapping the first time they are retrieved,
+ * so startup does not depend on the size of the database.
+ */
+database_t *snapshot_open(const char *);
+
+/**
+ * Returns nonzero if the file at the given path starts like a snapshot.
+ */
+int snapshot_check(const char *);
+
+#endif
@@ -0,0 +1,412 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+_Thread_local stats_thread_t *stats_self;
+
+/**
+ * Every thread's counters, in the order the threads first counted, and what
+ * is needed to dump them.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    stats_thread_t *threads;
+    stats_thread_t **last;
+    char **category_names;
+    int num_categories;
+    long started;
+} registry = {PTHREAD_MUTEX_INITIALIZER, NULL, &registry.threads, NULL, 0, 0};
+
+static const char *counter_names[NUM_STATS] = {
+    "wakeups", "spurious_wakeups", "queue_peak", "inflight_peak",
+    "orders_parsed", "parse_ns"
+};
+
+static const char *lock_names[NUM_STATS_LOCKS] = {
+    "queue", "customer", "pool", "log"
+};
+
+static const char *latency_names[NUM_LATENCIES] = {
+    "submit", "queue", "apply", "total"
+};
+
+/**
+ * Returns whether the counter is a peak rather than a sum.
+ */
+static int stats_is_peak(int counter) {
+    return counter == STAT_QUEUE_PEAK || counter == STAT_INFLIGHT_PEAK;
+}
+
+/**
+ * Starts counting.
+ */
+void stats_init(char **category_names, int num_categories) {
+    registry.category_names = category_names;
+    registry.num_categories = num_categories;
+    registry.started = stats_now();
+}
+
+/**
+ * Names the calling thread's counters, creating them first if need be. The
+ * block is rounded up to whole cache lines so that nothing else shares them.
+ * Counting has no way to report a failure, so the program exits if the block
+ * cannot be allocated.
+ */
+stats_thread_t *stats_register(const char *name, int index) {
+    stats_thread_t *self = stats_self;
+    size_t size;
+
+    if (!self) {
+        size = sizeof(stats_thread_t)
+               + 2 * registry.num_categories * sizeof(atomic_long);
+        size = (size + CACHELINE - 1) & ~((size_t) CACHELINE - 1);
+        if (posix_memalign((void **) &self, CACHELINE, size) != 0) {
+            fprintf(stderr, "Error: could not allocate thread counters\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(self, 0, size);
+        self->latencies = (_Atomic(stats_histogram_t *) *) calloc(
+                registry.num_categories + 1, sizeof(*self->latencies));
+        if (!self->latencies) {
+            fprintf(stderr, "Error: could not allocate thread counters\n");
+            exit(EXIT_FAILURE);
+        }
+        self->name = "thread";
+        self->index = -1;
+        self->num_categories = registry.num_categories;
+    }
+
+    // A dump may be reading the name
+    pthread_mutex_lock(&registry.mutex);
+    if (!stats_self) {
+        *registry.last = self;
+        registry.last = &self->next;
+        stats_self = self;
+    }
+    if (name) {
+        self->name = name;
+        self->index = index;
+    }
+    pthread_mutex_unlock(&registry.mutex);
+    return self;
+}
+
+/**
+ * Locks the mutex, timing the wait only if the first try fails, so that an
+ * uncontended lock costs one extra call.
+ */
+void stats_lock(pthread_mutex_t *mutex, stats_lock_t kind) {
+    stats_thread_t *self;
+    long start;
+
+    if (pthread_mutex_trylock(mutex) == 0)
+        return;
+    start = stats_now();
+    pthread_mutex_lock(mutex);
+    self = stats_get();
+    stats_add(&self->lock_waits[kind], 1);
+    stats_add(&self->lock_wait_ns[kind], stats_now() - start);
+}
+
+/**
+ * Waits on the condition. Every wait but the first of a loop means the last
+ * wakeup found nothing to do.
+ */
+void stats_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                     int *waits) {
+    stats_thread_t *self = stats_get();
+    if ((*waits)++ > 0)
+        stats_add(&self->counters[STAT_SPURIOUS_WAKEUPS], 1);
+    pthread_cond_wait(cond, mutex);
+    stats_add(&self->counters[STAT_WAKEUPS], 1);
+}
+
+/**
+ * Returns the monotonic clock in nanoseconds.
+ */
+long stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/**
+ * Returns the histogram bucket for the given latency.
+ */
+static int stats_bucket(long value) {
+    int exponent;
+
+    if (value < (1L << STATS_SUB_BITS))
+        return value < 0 ? 0 : (int) value;
+    exponent = 63 - __builtin_clzl((unsigned long) value);
+    if (exponent > STATS_MAX_EXPONENT)
+        return STATS_BUCKETS - 1;
+    return ((exponent - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+           + (int) ((value >> (exponent - STATS_SUB_BITS))
+                    & ((1L << STATS_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the highest latency that falls into the given bucket.
+ */
+static long stats_bucket_value(int bucket) {
+    int exponent, shift;
+
+    if (bucket < (1 << STATS_SUB_BITS))
+        return bucket;
+    exponent = (bucket >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    shift = exponent - STATS_SUB_BITS;
+    return ((long) ((1 << STATS_SUB_BITS) + (bucket & ((1 << STATS_SUB_BITS)
+                                                       - 1))) << shift)
+           + (1L << shift) - 1;
+}
+
+/**
+ * Stamps the order as applied and adds its latencies to the calling thread's
+ * histograms for its category, allocating them the first time.
+ */
+void stats_latency(long *stamps, int category) {
+    stats_thread_t *self = stats_get();
+    stats_histogram_t *histograms;
+    long latencies[NUM_LATENCIES];
+    int i;
+
+    stamps[STAGE_APPLIED] = stats_now();
+    if (category < 0 || category >= self->num_categories)
+        return;
+    for (i = 0; i < NUM_STAGES; i++) {
+        if (stamps[i] == 0)
+            return;
+    }
+    latencies[LATENCY_SUBMIT] = stamps[STAGE_ENQUEUED] - stamps[STAGE_PARSED];
+    latencies[LATENCY_QUEUE] = stamps[STAGE_DEQUEUED] - stamps[STAGE_ENQUEUED];
+    latencies[LATENCY_APPLY] = stamps[STAGE_APPLIED] - stamps[STAGE_DEQUEUED];
+    latencies[LATENCY_TOTAL] = stamps[STAGE_APPLIED] - stamps[STAGE_PARSED];
+
+    histograms = atomic_load_explicit(&self->latencies[category],
+                                      memory_order_relaxed);
+    if (!histograms) {
+        histograms = (stats_histogram_t *) calloc(NUM_LATENCIES,
+                                                  sizeof(stats_histogram_t));
+        if (!histograms)
+            return;
+        // Readers of a dump must see the histograms zeroed
+        atomic_store_explicit(&self->latencies[category], histograms,
+                              memory_order_release);
+    }
+    for (i = 0; i < NUM_LATENCIES; i++) {
+        stats_add(&histograms[i].buckets[stats_bucket(latencies[i])], 1);
+        stats_max(&histograms[i].max, latencies[i]);
+    }
+}
+
+/**
+ * Writes the latencies of every category, merged over every thread, as a JSON
+ * member preceded by a comma: for each latency, the given percentiles and the
+ * maximum in nanoseconds. A percentile is the highest value of the bucket it
+ * falls into, so it overstates the latency by at most a sixteenth. Categories
+ * with no orders applied are left out. Call it with the registry locked.
+ */
+static void stats_dump_latencies(FILE *file) {
+    static const double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *percentile_names[] = {"p50", "p90", "p99", "p999"};
+    long *buckets, count, max, seen, target;
+    stats_histogram_t *histograms;
+    stats_thread_t *thread;
+    const char *separator = "";
+    int b, c, l, p;
+
+    buckets = (long *) malloc(STATS_BUCKETS * sizeof(long));
+    if (!buckets)
+        return;
+    fprintf(file, ",\"latency_ns\":{");
+    for (c = 0; c < registry.num_categories; c++) {
+        for (l = 0; l < NUM_LATENCIES; l++) {
+            memset(buckets, 0, STATS_BUCKETS * sizeof(long));
+            count = max = 0;
+            for (thread = registry.threads; thread; thread = thread->next) {
+                histograms = c < thread->num_categories
+                             ? atomic_load_explicit(&thread->latencies[c],
+                                                    memory_order_acquire)
+                             : NULL;
+                if (!histograms)
+                    continue;
+                for (b = 0; b < STATS_BUCKETS; b++) {
+                    buckets[b] += atomic_load_explicit(
+                            &histograms[l].buckets[b], memory_order_relaxed);
+                }
+                if (atomic_load_explicit(&histograms[l].max,
+                                         memory_order_relaxed) > max)
+                    max = atomic_load_explicit(&histograms[l].max,
+                                               memory_order_relaxed);
+            }
+            for (b = 0; b < STATS_BUCKETS; b++) {
+                count += buckets[b];
+            }
+            if (count == 0)
+                break;
+
+            if (l == 0) {
+                fprintf(file, "%s\"%s\":{\"orders\":%ld", separator,
+                        registry.category_names[c], count);
+                separator = ",";
+            }
+            fprintf(file, ",\"%s\":{", latency_names[l]);
+            for (p = 0, b = 0, seen = 0; p < 4; p++) {
+                target = (long) (percentiles[p] * count + 0.999999);
+                while (b < STATS_BUCKETS - 1 && seen + buckets[b] < target)
+                    seen += buckets[b++];
+                fprintf(file, "\"%s\":%ld,", percentile_names[p],
+                        stats_bucket_value(b) < max ? stats_bucket_value(b)
+                                                    : max);
+            }
+            fprintf(file, "\"max\":%ld}", max);
+        }
+        if (l > 0)
+            fprintf(file, "}");
+    }
+    fprintf(file, "}");
+    free(buckets);
+}
+
+/**
+ * Writes the counters and lock waits of one thread, or their totals, as JSON
+ * members, each preceded by a comma. Counters that are zero are left out.
+ */
+static void stats_dump_counters(FILE *file, long *counters, long *waits,
+                                long *wait_ns) {
+    int i;
+
+    for (i = 0; i < NUM_STATS; i++) {
+        if (counters[i])
+            fprintf(file, ",\"%s\":%ld", counter_names[i], counters[i]);
+    }
+    for (i = 0; i < NUM_STATS_LOCKS; i++) {
+        if (waits[i]) {
+            fprintf(file, ",\"%s_lock_waits\":%ld,\"%s_lock_wait_ns\":%ld",
+                    lock_names[i], waits[i], lock_names[i], wait_ns[i]);
+        }
+    }
+}
+
+/**
+ * Writes the orders processed and rejected, in all and per category, as JSON
+ * members, each preceded by a comma. Categories with no orders are left out,
+ * and so is everything if there were no orders at all.
+ */
+static void stats_dump_categories(FILE *file, long *categories,
+                                  int num_categories) {
+    const char *separator = "";
+    long processed = 0, rejected = 0;
+    int c;
+
+    for (c = 0; c < num_categories; c++) {
+        processed += categories[2 * c];
+        rejected += categories[2 * c + 1];
+    }
+    if (processed == 0)
+        return;
+
+    fprintf(file, ",\"processed\":%ld,\"rejected\":%ld,\"categories\":{",
+            processed, rejected);
+    for (c = 0; c < num_categories; c++) {
+        if (categories[2 * c]) {
+            fprintf(file, "%s\"%s\":{\"processed\":%ld,\"rejected\":%ld}",
+                    separator, registry.category_names[c], categories[2 * c],
+                    categories[2 * c + 1]);
+            separator = ",";
+        }
+    }
+    fprintf(file, "}");
+}
+
+/**
+ * Writes every thread's counters, in the order the threads first counted,
+ * followed by the totals. The counters keep changing while they are read, so a
+ * dump taken while the program runs is only a snapshot.
+ */
+void stats_dump(FILE *file, const char *event) {
+    long counters[NUM_STATS], waits[NUM_STATS_LOCKS], wait_ns[NUM_STATS_LOCKS];
+    long total_counters[NUM_STATS] = {0};
+    long total_waits[NUM_STATS_LOCKS] = {0};
+    long total_wait_ns[NUM_STATS_LOCKS] = {0};
+    long categories[2 * registry.num_categories + 1];
+    long total_categories[2 * registry.num_categories + 1];
+    stats_thread_t *thread;
+    const char *separator = "";
+    int c, i, num_threads = 0;
+
+    memset(total_categories, 0, sizeof(total_categories));
+    pthread_mutex_lock(&registry.mutex);
+    flockfile(file);
+    fprintf(file, "{\"event\":\"%s\",\"seconds\":%.3f,\"threads\":[", event,
+            (stats_now() - registry.started) / 1e9);
+    for (thread = registry.threads; thread; thread = thread->next) {
+        for (i = 0; i < NUM_STATS; i++) {
+            counters[i] = atomic_load_explicit(&thread->counters[i],
+                                               memory_order_relaxed);
+            if (!stats_is_peak(i))
+                total_counters[i] += counters[i];
+            else if (counters[i] > total_counters[i])
+                total_counters[i] = counters[i];
+        }
+        for (i = 0; i < NUM_STATS_LOCKS; i++) {
+            waits[i] = atomic_load_explicit(&thread->lock_waits[i],
+                                            memory_order_relaxed);
+            wait_ns[i] = atomic_load_explicit(&thread->lock_wait_ns[i],
+                                              memory_order_relaxed);
+            total_waits[i] += waits[i];
+            total_wait_ns[i] += wait_ns[i];
+        }
+        for (c = 0; c < 2 * thread->num_categories; c++) {
+            categories[c] = atomic_load_explicit(&thread->categories[c],
+                                                 memory_order_relaxed);
+            total_categories[c] += categories[c];
+        }
+
+        fprintf(file, "%s{\"thread\":\"%s\"", separator, thread->name);
+        if (thread->index >= 0)
+            fprintf(file, ",\"index\":%d", thread->index);
+        stats_dump_counters(file, counters, waits, wait_ns);
+        stats_dump_categories(file, categories, thread->num_categories);
+        fprintf(file, "}");
+        separator = ",";
+        num_threads++;
+    }
+    fprintf(file, "],\"totals\":{\"threads\":%d", num_threads);
+    stats_dump_counters(file, total_counters, total_waits, total_wait_ns);
+    stats_dump_categories(file, total_categories, registry.num_categories);
+    fprintf(file, "}");
+    stats_dump_latencies(file);
+    fprintf(file, "}\n");
+    fflush(file);
+    funlockfile(file);
+    pthread_mutex_unlock(&registry.mutex);
+}
+
+/**
+ * Frees every thread's counters.
+ */
+void stats_destroy(void) {
+    stats_thread_t *thread, *next;
+    int c;
+
+    pthread_mutex_lock(&registry.mutex);
+    for (thread = registry.threads; thread; thread = next) {
+        next = thread->next;
+        for (c = 0; c < thread->num_categories; c++) {
+            free(atomic_load(&thread->latencies[c]));
+        }
+        free(thread->latencies);
+        free(thread);
+    }
+    registry.threads = NULL;
+    registry.last = &registry.threads;
+    pthread_mutex_unlock(&registry.mutex);
+    stats_self = NULL;
+}
@@ -0,0 +1,247 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ring.h"
+
+/**
+ * Runtime counters for finding out where a run spends its time. They are only
+ * compiled in when STATS is defined (make STATS=1); otherwise every STATS_
+ * macro below expands to the plain call or to nothing, and costs nothing.
+ *
+ * Every thread that counts something gets its own block of counters, on cache
+ * lines of its own, so counting is a load and a store that no other thread
+ * writes to. A thread's block is created the first time it counts, or when it
+ * names itself with STATS_THREAD(), and outlives the thread, so the counts of
+ * threads that have exited still show. STATS_DUMP() writes every block and the
+ * totals as one line of JSON.
+ *
+ * Orders are also timed through the program. Each order is stamped when it is
+ * parsed, enqueued for a worker, dequeued by one and applied, and the worker
+ * that applies it records the time between the stamps in its own latency
+ * histograms for the order's category. The dump merges the histograms of every
+ * thread and gives percentiles per category.
+ */
+
+/**
+ * The counters each thread keeps. Peaks are maximums; the rest are sums.
+ */
+typedef enum stats_counter {
+    STAT_WAKEUPS,           // Returns from a condition wait
+    STAT_SPURIOUS_WAKEUPS,  // ... after which the thread had to wait again
+    STAT_QUEUE_PEAK,        // Most items seen in a queue after an enqueue
+    STAT_INFLIGHT_PEAK,     // Most orders in flight in the worker pool
+    STAT_ORDERS_PARSED,
+    STAT_PARSE_NS,          // Time spent parsing them
+    NUM_STATS
+} stats_counter_t;
+
+/**
+ * The kinds of lock whose contention is counted: the mutex of a queue or ring
+ * buffer, the customer lock stripes, the worker pool's mutex and the
+ * write-ahead log's buffer.
+ */
+typedef enum stats_lock {
+    STATS_QUEUE_LOCK,
+    STATS_CUSTOMER_LOCK,
+    STATS_POOL_LOCK,
+    STATS_LOG_LOCK,
+    NUM_STATS_LOCKS
+} stats_lock_t;
+
+/**
+ * Where an order is stamped on its way through the program.
+ */
+typedef enum stats_stage {
+    STAGE_PARSED,
+    STAGE_ENQUEUED,
+    STAGE_DEQUEUED,
+    STAGE_APPLIED,
+    NUM_STAGES
+} stats_stage_t;
+
+/**
+ * The latencies recorded for each order: from parsing to being enqueued, which
+ * includes waiting for room in the pool; waiting in the queue; being applied;
+ * and the whole way from parsing to applied.
+ */
+typedef enum stats_latency {
+    LATENCY_SUBMIT,
+    LATENCY_QUEUE,
+    LATENCY_APPLY,
+    LATENCY_TOTAL,
+    NUM_LATENCIES
+} stats_latency_t;
+
+/**
+ * A histogram of latencies in nanoseconds, in the style of an HDR histogram:
+ * values below 2^STATS_SUB_BITS have a bucket each, and every power of two
+ * above is split into 2^STATS_SUB_BITS linear buckets, so a bucket is never
+ * wider than 1/16 of its values however large they get. Values from 2^45 ns
+ * (about ten hours) up all land in the last bucket. The maximum is kept
+ * exactly.
+ */
+#define STATS_SUB_BITS 4
+#define STATS_MAX_EXPONENT 44
+#define STATS_BUCKETS \
+    ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) << STATS_SUB_BITS)
+
+typedef struct stats_histogram {
+    atomic_long max;
+    atomic_long buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+/**
+ * The counters of one thread. A lock is only counted when it was already
+ * held, along with the time spent waiting for it. The category counts are
+ * pairs of orders processed and rejected, by category ID. The latency
+ * histograms of a category are only allocated once the thread applies an order
+ * of it.
+ */
+typedef struct stats_thread {
+    _Alignas(CACHELINE) atomic_long counters[NUM_STATS];
+    atomic_long lock_waits[NUM_STATS_LOCKS];
+    atomic_long lock_wait_ns[NUM_STATS_LOCKS];
+    _Atomic(stats_histogram_t *) *latencies;
+    const char *name;
+    int index;
+    int num_categories;
+    struct stats_thread *next;
+    atomic_long categories[];
+} stats_thread_t;
+
+/**
+ * The calling thread's counters, or NULL until it first counts something.
+ */
+extern _Thread_local stats_thread_t *stats_self;
+
+/**
+ * Starts counting, with the names of the categories whose orders are counted.
+ * Call it before starting any thread.
+ */
+void stats_init(char **, int);
+
+/**
+ * Names the calling thread's counters, as the given role and index; the index
+ * is left out of the dump if it is negative. Returns the thread's counters.
+ */
+stats_thread_t *stats_register(const char *, int);
+
+/**
+ * Locks the mutex, counting the wait against the given kind of lock if the
+ * mutex was already held.
+ */
+void stats_lock(pthread_mutex_t *, stats_lock_t);
+
+/**
+ * Waits on the condition. The int counts the waits of one wait loop, so that
+ * a wakeup followed by another wait is counted as spurious.
+ */
+void stats_cond_wait(pthread_cond_t *, pthread_mutex_t *, int *);
+
+/**
+ * Returns the monotonic clock in nanoseconds.
+ */
+long stats_now(void);
+
+/**
+ * Stamps an order as applied and records its latencies for the given category
+ * in the calling thread's histograms. Orders missing a stamp are not recorded.
+ */
+void stats_latency(long *, int);
+
+/**
+ * Writes every thread's counters and the totals to the file as one line of
+ * JSON, labelled with the given event.
+ */
+void stats_dump(FILE *, const char *);
+
+/**
+ * Frees every thread's counters. No thread may count anything afterwards.
+ */
+void stats_destroy(void);
+
+/**
+ * Returns the calling thread's counters, creating them if need be.
+ */
+static inline stats_thread_t *stats_get(void) {
+    return stats_self ? stats_self : stats_register(NULL, -1);
+}
+
+/**
+ * Adds to one of the calling thread's counters. Only the owning thread writes
+ * a counter, so a relaxed load and store are enough for readers to see whole
+ * values.
+ */
+static inline void stats_add(atomic_long *counter, long n) {
+    atomic_store_explicit(counter, atomic_load_explicit(
+            counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Raises one of the calling thread's peaks to the given value.
+ */
+static inline void stats_max(atomic_long *counter, long value) {
+    if (value > atomic_load_explicit(counter, memory_order_relaxed))
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+/**
+ * Counts an order of the given category as processed, and as rejected if it
+ * was.
+ */
+static inline void stats_category(int category, int rejected) {
+    stats_thread_t *self = stats_get();
+    if (category >= 0 && category < self->num_categories) {
+        stats_add(&self->categories[2 * category], 1);
+        if (rejected)
+            stats_add(&self->categories[2 * category + 1], 1);
+    }
+}
+
+#ifdef STATS
+#define STATS_INIT(names, count) stats_init(names, count)
+#define STATS_THREAD(name, index) stats_register(name, index)
+#define STATS_ADD(counter, n) stats_add(&stats_get()->counters[counter], n)
+#define STATS_MAX(counter, value) \
+    stats_max(&stats_get()->counters[counter], (long) (value))
+#define STATS_CATEGORY(category, rejected) stats_category(category, rejected)
+#define STATS_LOCK(mutex, kind) stats_lock(mutex, kind)
+#define STATS_COND_WAIT(cond, mutex, waits) \
+    stats_cond_wait(cond, mutex, &(waits))
+#define STATS_TIMED(counter, statement) do { \
+        long stats_start_ = stats_now(); \
+        statement; \
+        STATS_ADD(counter, stats_now() - stats_start_); \
+    } while (0)
+#define STATS_STAMP(order, stage) ((order)->stamps[stage] = stats_now())
+#define STATS_STAMP_NEW(order) do { \
+        memset((order)->stamps, 0, sizeof((order)->stamps)); \
+        STATS_STAMP(order, STAGE_PARSED); \
+    } while (0)
+#define STATS_LATENCY(order) \
+    stats_latency((order)->stamps, (order)->category_id)
+#define STATS_DUMP(file, event) stats_dump(file, event)
+#define STATS_DESTROY() stats_destroy()
+#else
+#define STATS_INIT(names, count) ((void) 0)
+#define STATS_THREAD(name, index) ((void) 0)
+#define STATS_ADD(counter, n) ((void) 0)
+#define STATS_MAX(counter, value) ((void) 0)
+#define STATS_CATEGORY(category, rejected) ((void) 0)
+#define STATS_LOCK(mutex, kind) pthread_mutex_lock(mutex)
+#define STATS_COND_WAIT(cond, mutex, waits) \
+    ((void) (waits), pthread_cond_wait(cond, mutex))
+#define STATS_TIMED(counter, statement) do { statement; } while (0)
+#define STATS_STAMP(order, stage) ((void) 0)
+#define STATS_STAMP_NEW(order) ((void) 0)
+#define STATS_LATENCY(order) ((void) 0)
+#define STATS_DUMP(file, event) ((void) 0)
+#define STATS_DESTROY() ((void) 0)
+#endif
+
+#endif
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream.h"
+
+/**
+ * The initial size of a stream's buffer. It doubles for longer lines.
+ */
+#define STREAMBUFFER 65536
+
+/**
+ * Opens the stream. A followed named pipe is opened for writing as well as
+ * reading, so that it never reaches end of file when its last writer leaves.
+ */
+stream_t *stream_open(const char *path, int follow) {
+    struct stat info;
+    stream_t *stream;
+    int flags;
+
+    stream = (stream_t *) calloc(1, sizeof(stream_t));
+    if (!stream)
+        return NULL;
+    stream->follow = follow;
+    stream->capacity = STREAMBUFFER;
+    stream->buffer = (char *) malloc(stream->capacity);
+    if (!stream->buffer || pipe(stream->wake) != 0) {
+        free(stream->buffer);
+        free(stream);
+        return NULL;
+    }
+    atomic_init(&stream->stopped, 0);
+
+    if (strcmp(path, "-") == 0) {
+        stream->fd = STDIN_FILENO;
+    }
+    else {
+        flags = O_RDONLY;
+        if (follow && stat(path, &info) == 0 && S_ISFIFO(info.st_mode))
+            flags = O_RDWR;
+        if ((stream->fd = open(path, flags)) < 0) {
+            close(stream->wake[0]);
+            close(stream->wake[1]);
+            free(stream->buffer);
+            free(stream);
+            return NULL;
+        }
+    }
+    return stream;
+}
+
+/**
+ * Closes the stream. Standard input is left open.
+ */
+void stream_close(stream_t *stream) {
+    if (stream) {
+        if (stream->fd != STDIN_FILENO)
+            close(stream->fd);
+        close(stream->wake[0]);
+        close(stream->wake[1]);
+        free(stream->buffer);
+        free(stream);
+    }
+}
+
+/**
+ * Waits until the stream's file is readable or the stream is stopped, for at
+ * most the given number of milliseconds, or forever if it is negative. Only
+ * the wake pipe is watched if the file is not. Returns 0 if the stream was
+ * stopped, or 1 otherwise.
+ */
+static int stream_wait(stream_t *stream, int watch_file, int timeout) {
+    struct pollfd fds[2];
+
+    fds[0].fd = stream->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = stream->fd;
+    fds[1].events = POLLIN;
+    while (poll(fds, watch_file ? 2 : 1, timeout) < 0) {
+        if (errno != EINTR)
+            break;
+    }
+    return !atomic_load(&stream->stopped);
+}
+
+/**
+ * Returns the next line. Lines are cut out of the buffer in place; the buffer
+ * is only refilled once it holds no complete line.
+ */
+char *stream_next_line(stream_t *stream, size_t *length) {
+    char *line, *newline;
+    ssize_t count;
+
+    for (;;) {
+        if (atomic_load(&stream->stopped))
+            return NULL;
+
+        line = stream->buffer + stream->start;
+        newline = memchr(line, '\n', stream->end - stream->start);
+        if (newline) {
+            *newline = '\0';
+            *length = newline - line;
+            stream->start = newline - stream->buffer + 1;
+            stream->offset += *length + 1;
+            return line;
+        }
+
+        // Make room for more input after the partial line
+        if (stream->start > 0) {
+            memmove(stream->buffer, line, stream->end - stream->start);
+            stream->end -= stream->start;
+            stream->start = 0;
+        }
+        if (stream->end == stream->capacity) {
+            if ((line = (char *) realloc(stream->buffer,
+                                         2 * stream->capacity)) == NULL)
+                return NULL;
+            stream->buffer = line;
+            stream->capacity *= 2;
+        }
+
+        if (!stream_wait(stream, 1, -1))
+            return NULL;
+        count = read(stream->fd, stream->buffer + stream->end,
+                     stream->capacity - stream->end);
+        if (count > 0) {
+            stream->end += count;
+        }
+        else if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        else if (count == 0 && stream->follow) {
+            // Wait for the file to grow
+            if (!stream_wait(stream, 0, STREAM_FOLLOW_INTERVAL))
+                return NULL;
+        }
+        else if (stream->end > stream->start) {
+            // The last line has no newline
+            stream->buffer[stream->end] = '\0';
+            *length = stream->end - stream->start;
+            line = stream->buffer + stream->start;
+            stream->start = stream->end;
+            stream->offset += *length;
+            return line;
+        }
+        else {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * Skips the stream ahead to the given offset. Pipes and standard input cannot
+ * seek, so their bytes are read through the buffer and dropped.
+ */
+int stream_seek(stream_t *stream, size_t offset) {
+    ssize_t count;
+
+    if (offset == 0)
+        return 0;
+    if (lseek(stream->fd, (off_t) offset, SEEK_SET) == (off_t) offset) {
+        stream->offset = offset;
+        return 0;
+    }
+    while (stream->offset < offset) {
+        if (!stream_wait(stream, 1, -1))
+            return -1;
+        count = read(stream->fd, stream->buffer,
+                     offset - stream->offset < stream->capacity
+                     ? offset - stream->offset : stream->capacity);
+        if (count < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (count <= 0)
+            return -1;
+        stream->offset += count;
+    }
+    return 0;
+}
+
+/**
+ * Stops the stream and wakes up its reader.
+ */
+void stream_stop(stream_t *stream) {
+    atomic_store(&stream->stopped, 1);
+    if (write(stream->wake[1], "", 1) < 0) {
+        // The pipe is full, so the reader is being woken already
+    }
+}
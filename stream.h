@@ -0,0 +1,69 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * How long a followed file is left alone after it runs out of data, in
+ * milliseconds, before it is read again.
+ */
+#define STREAM_FOLLOW_INTERVAL 200
+
+/**
+ * A line reader over a file, a pipe or standard input. Reading can be stopped
+ * from another thread, which wakes up a reader blocked waiting for input.
+ *
+ * A followed stream does not end at end of file: a regular file is read again
+ * as it grows, like tail -f, and a named pipe stays open between writers. It
+ * only ends once it is stopped.
+ *
+ * The offset counts the bytes of every line returned so far, newlines
+ * included, so that a later run can pick up where this one stopped.
+ */
+typedef struct stream {
+    int fd;
+    int follow;
+    int wake[2];
+    atomic_int stopped;
+    char *buffer;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    size_t offset;
+} stream_t;
+
+/**
+ * Opens the file at the given path for reading, or standard input if the path
+ * is "-". Returns NULL if the file cannot be opened.
+ */
+stream_t *stream_open(const char *, int);
+
+/**
+ * Closes the stream.
+ */
+void stream_close(stream_t *);
+
+/**
+ * Returns the next line, without its newline and null-terminated, and stores
+ * its length. The line is valid until the next call. Returns NULL at the end
+ * of the stream, or once the stream has been stopped. A final line without a
+ * newline is returned at the end of an unfollowed stream.
+ */
+char *stream_next_line(stream_t *, size_t *);
+
+/**
+ * Skips the stream ahead to the given offset, seeking if the file allows it and
+ * reading and discarding the bytes before it otherwise. Must be called before
+ * the first line is read. Returns 0 on success, or -1 if the stream ends or is
+ * stopped before the offset.
+ */
+int stream_seek(stream_t *, size_t);
+
+/**
+ * Stops the stream. A reader waiting for input returns NULL right away, and
+ * lines already read are not returned.
+ */
+void stream_stop(stream_t *);
+
+#endif
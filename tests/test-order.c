@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Checks that bookorder confirms each customer's orders in the order they were
+ * placed, however many threads apply them. It writes a database and an order
+ * file in which every title names its customer and the order's number among
+ * that customer's orders, runs ./bookorder -o summary over them with several
+ * worker, parser and shard counts, and reads the summary lines back. A few
+ * customers place most of the orders, so the busy ones are put back on a run
+ * queue and stolen by other workers over and over.
+ *
+ * It then runs bookorder -o full over the same files into a reader that takes
+ * its output slowly, and checks that the program's peak memory stays bounded:
+ * the writer must hold back the workers, and they the producer, instead of
+ * piling the output up. Prints one line per run and exits with a failure
+ * status if any run fails.
+ */
+
+#define CUSTOMERS 2000
+#define ORDERS 400000
+
+/**
+ * How fast the slow reader reads, in bytes every millisecond, and how much more
+ * memory, in kilobytes, bookorder may use than it does with a reader that keeps
+ * up. Unbounded, the output waiting for the slow reader takes over 500 MB.
+ */
+#define SLOWREAD 16384
+#define SLOWRSS (32 * 1024)
+
+/**
+ * The options of each run.
+ */
+const char *runs[] = {
+    "-w 1", "-w 2", "-w 4", "-w 8", "-w 4 -j 2", "-w 8 -m",
+    "-w 4 --max-inflight 64", "-s 4"
+};
+
+/**
+ * The next number from a 64-bit xorshift generator, so that the files are the
+ * same on every run.
+ */
+unsigned long state = 88172645463325252UL;
+
+unsigned long next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * Writes the database and the order file. Half of the orders go to the first
+ * eight customers and the rest are spread over all of them. Every customer has
+ * enough credit for all of its orders, so the output does not depend on which
+ * orders are rejected either. Returns 0 on success.
+ */
+int write_files(const char *database_path, const char *orders_path,
+                long *placed) {
+    FILE *database, *orders;
+    long customer, i;
+
+    if ((database = fopen(database_path, "w")) == NULL
+            || (orders = fopen(orders_path, "w")) == NULL)
+        return -1;
+    for (i = 1; i <= CUSTOMERS; i++) {
+        fprintf(database, "\"Customer %ld\"| %ld| 10000000.00| "
+                "\"%ld Main St\"| \"New Jersey\"| \"08854\"\n", i, i, i);
+    }
+    for (i = 0; i < ORDERS; i++) {
+        if (next_random() % 2)
+            customer = 1 + (long) (next_random() % 8);
+        else
+            customer = 1 + (long) (next_random() % CUSTOMERS);
+        fprintf(orders, "\"Book %ld-%ld\"|1.00|%ld|CAT%ld\n", customer,
+                placed[customer]++, customer, (long) (next_random() % 4));
+    }
+    if (fclose(database) != 0 || fclose(orders) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Runs bookorder with the given options and checks its summary lines. Returns
+ * the number of lines that did not follow their customer's previous line, plus
+ * the number of customers with lines missing.
+ */
+long check_run(const char *options, const char *database_path,
+               const char *orders_path, const long *placed) {
+    char command[1024], line[256];
+    long *seen, *expected, customer, number, errors = 0;
+    FILE *output;
+    int i;
+
+    seen = (long *) calloc(CUSTOMERS + 1, sizeof(long));
+    expected = (long *) calloc(CUSTOMERS + 1, sizeof(long));
+    if (!seen || !expected) {
+        free(seen);
+        free(expected);
+        return -1;
+    }
+    snprintf(command, sizeof(command), "./bookorder -o summary %s %s %s "
+             "\"CAT0 CAT1 CAT2 CAT3\"", options, database_path, orders_path);
+    if ((output = popen(command, "r")) == NULL) {
+        free(seen);
+        free(expected);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), output)) {
+        if (sscanf(line, "OK|%*d|\"Book %ld-%ld\"|", &customer, &number) != 2)
+            continue;
+        if (customer < 1 || customer > CUSTOMERS) {
+            errors++;
+            continue;
+        }
+        // Count each line that does not follow the customer's previous one
+        if (number != expected[customer])
+            errors++;
+        expected[customer] = number + 1;
+        seen[customer]++;
+    }
+    if (pclose(output) != 0)
+        errors++;
+    for (i = 1; i <= CUSTOMERS; i++) {
+        if (seen[i] != placed[i])
+            errors++;
+    }
+    free(seen);
+    free(expected);
+    return errors;
+}
+
+/**
+ * Runs bookorder with the given options into a pipe, pausing after each read if
+ * slow is set, and returns its peak resident set size in kilobytes, or -1 if it
+ * failed.
+ */
+long check_reader(const char *options, const char *database_path,
+                  const char *orders_path, int slow) {
+    char command[1024], buffer[SLOWREAD];
+    struct timespec pause = {0, 1000000};
+    struct rusage usage;
+    int pipes[2], status;
+    pid_t pid;
+
+    snprintf(command, sizeof(command), "exec ./bookorder -o full %s %s %s "
+             "\"CAT0 CAT1 CAT2 CAT3\"", options, database_path, orders_path);
+    if (pipe(pipes) != 0)
+        return -1;
+    if ((pid = fork()) < 0) {
+        close(pipes[0]);
+        close(pipes[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(pipes[1], STDOUT_FILENO);
+        close(pipes[0]);
+        close(pipes[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+        _exit(127);
+    }
+    close(pipes[1]);
+    while (read(pipes[0], buffer, sizeof(buffer)) > 0) {
+        if (slow)
+            nanosleep(&pause, NULL);
+    }
+    close(pipes[0]);
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        return -1;
+    return usage.ru_maxrss;
+}
+
+int main(void) {
+    char database_path[] = "/tmp/test-order-db-XXXXXX";
+    char orders_path[] = "/tmp/test-order-orders-XXXXXX";
+    long *placed, errors, fast, slow;
+    int fd, failed = 0;
+    size_t i;
+
+    if ((fd = mkstemp(database_path)) < 0)
+        return EXIT_FAILURE;
+    close(fd);
+    if ((fd = mkstemp(orders_path)) < 0) {
+        unlink(database_path);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    placed = (long *) calloc(CUSTOMERS + 1, sizeof(long));
+    if (!placed || write_files(database_path, orders_path, placed) != 0) {
+        fprintf(stderr, "Error: could not write the test files\n");
+        failed = 1;
+    }
+    else {
+        for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+            errors = check_run(runs[i], database_path, orders_path, placed);
+            printf("%s - bookorder %s: %ld lines out of order\n",
+                   errors == 0 ? "ok" : "not ok", runs[i], errors);
+            if (errors != 0)
+                failed++;
+        }
+        fast = check_reader("-w 4", database_path, orders_path, 0);
+        slow = check_reader("-w 4", database_path, orders_path, 1);
+        errors = fast < 0 || slow < 0 || slow > fast + SLOWRSS;
+        printf("%s - bookorder -w 4 into a slow reader: peak RSS %ld KB, "
+               "%ld KB into a fast one\n", errors ? "not ok" : "ok", slow,
+               fast);
+        if (errors)
+            failed++;
+        printf("%d failed\n", failed);
+    }
+
+    unlink(database_path);
+    unlink(orders_path);
+    free(placed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
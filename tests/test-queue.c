@@ -1,51 +1,321 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
 
 #include "../node.h"
 #include "../queue.h"
 
-queue_t *queue;
+/**
+ * Checks the queue in queue.c, both as a linked list and as a ring buffer. The
+ * single-threaded tests check the basic operations; the stress tests run
+ * several producers against several consumers and check that every item comes
+ * out exactly once and that the items of each producer come out in the order
+ * they went in, as seen by each consumer. Prints one line per test and exits
+ * with a failure status if any test fails.
+ */
+
+/**
+ * How consumers take items off the queue in a stress test. PEEK is the pattern
+ * of the old per-category consumers: under the queue's mutex, peek at the head
+ * and only dequeue it if it is yours, otherwise let go and yield.
+ */
+typedef enum stress_mode {
+    MODE_POP,
+    MODE_BATCH,
+    MODE_PEEK
+} stress_mode_t;
+
+const char *mode_names[] = {"pop", "batch", "peek"};
+
+#define BATCHSIZE 16
+
+/**
+ * A stress test in progress. Items are encoded in the pointer itself as the
+ * producer in the high bits and the sequence number plus one in the low bits,
+ * so that no item is NULL.
+ */
+typedef struct stress {
+    queue_t *queue;
+    stress_mode_t mode;
+    int producers;
+    int consumers;
+    long items;
+    atomic_uchar *seen;
+    atomic_long duplicates;
+    atomic_long reordered;
+    atomic_long foreign;
+} stress_t;
+
+typedef struct worker {
+    stress_t *stress;
+    int index;
+} worker_t;
+
+int failures;
+
+void report(int ok, const char *name, const char *detail) {
+    printf("%s - %s%s%s\n", ok ? "ok" : "not ok", name, detail ? ": " : "",
+           detail ? detail : "");
+    if (!ok)
+        failures++;
+}
+
+void *encode(int producer, long sequence) {
+    return (void *) (((uintptr_t) producer << 32) | (uintptr_t) (sequence + 1));
+}
+
+int item_producer(const void *item) {
+    return (int) ((uintptr_t) item >> 32);
+}
+
+long item_sequence(const void *item) {
+    return (long) ((uintptr_t) item & 0xFFFFFFFFUL) - 1;
+}
+
+long destroyed;
+
+void count_destroyed(void *item) {
+    destroyed++;
+}
+
+/**
+ * Runs the basic operations on one thread: FIFO order, size, peek, empty
+ * checks, a closed ring refusing items, and destroying a queue that still holds
+ * items.
+ */
+void single_thread_test(int ring) {
+    const char *name = ring ? "single thread, ring" : "single thread, list";
+    queue_t *queue = ring ? queue_create_ring(128) : queue_create();
+    void *batch[8];
+    long i;
+
+    if (!queue_isempty(queue) || queue_dequeue(queue) != NULL
+            || queue_peek(queue) != NULL) {
+        report(0, name, "new queue is not empty");
+        return;
+    }
+    for (i = 0; i < 100; i++) {
+        if (!queue_enqueue(queue, encode(0, i))) {
+            report(0, name, "enqueue refused");
+            return;
+        }
+    }
+    if (queue_size(queue) != 100 || queue_isempty(queue)
+            || queue_peek(queue) != encode(0, 0)) {
+        report(0, name, "wrong size or head after enqueue");
+        return;
+    }
+    for (i = 0; i < 50; i++) {
+        if (queue_dequeue(queue) != encode(0, i)) {
+            report(0, name, "dequeue out of order");
+            return;
+        }
+    }
+    if (queue_dequeue_batch(queue, batch, 8) != 8 || batch[0] != encode(0, 50)
+            || batch[7] != encode(0, 57)) {
+        report(0, name, "batch dequeue out of order");
+        return;
+    }
+    if (ring) {
+        // A closed ring refuses new items and hands them back
+        queue_close(queue);
+        batch[0] = encode(1, 0);
+        batch[1] = encode(1, 1);
+        if (queue_push(queue, encode(1, 2))
+                || queue_enqueue_batch(queue, batch, 2) != 0) {
+            report(0, name, "closed ring took an item");
+            return;
+        }
+    }
+    destroyed = 0;
+    queue_destroy(queue, count_destroyed);
+    report(destroyed == 42, name, destroyed == 42 ? NULL
+           : "destroy missed items");
+}
+
+/**
+ * Takes one item as seen by a consumer: marks it seen and checks that it comes
+ * after the last item the consumer saw from the same producer.
+ */
+void take(stress_t *stress, long *last, void *item) {
+    int producer = item_producer(item);
+    long sequence = item_sequence(item);
+
+    if (atomic_fetch_add(&stress->seen[producer * stress->items + sequence],
+                         1) != 0)
+        atomic_fetch_add(&stress->duplicates, 1);
+    if (sequence <= last[producer])
+        atomic_fetch_add(&stress->reordered, 1);
+    last[producer] = sequence;
+}
 
+void *producer_thread(void *args) {
+    worker_t *worker = (worker_t *) args;
+    stress_t *stress = worker->stress;
+    void *batch[BATCHSIZE];
+    long i, j;
 
-void single_thread_test() {
-    char *itemOne = "single-thread-item-1";
-    char *itemTwo = "single-thread-item-2";
-    char *dequeued_item = NULL;
-    queue_t *queue = queue_create();
-    queue_enqueue(queue, itemOne);
-    queue_enqueue(queue, itemTwo);
-    dequeued_item = queue_dequeue(queue);
-    printf("dequeued_item = %s\n", dequeued_item);
-    /*
-    dequeued_item = queue_dequeue(queue);
-    printf("dequeued_item = %s\n", dequeued_item);
-    */
-    printf("pointer to queue before destroy = %p\n",queue);
-    queue_destroy(queue);
-    printf("pointer to queue after destroy = %p\n",queue);
+    for (i = 0; i < stress->items; i += BATCHSIZE) {
+        for (j = 0; j < BATCHSIZE && i + j < stress->items; j++) {
+            batch[j] = encode(worker->index, i + j);
+        }
+        if (stress->mode == MODE_BATCH) {
+            queue_enqueue_batch(stress->queue, batch, j);
+            continue;
+        }
+        for (j = 0; j < BATCHSIZE && i + j < stress->items; j++) {
+            if (stress->mode == MODE_PEEK) {
+                // Every consumer may be waiting for its own items
+                pthread_mutex_lock(&stress->queue->mutex);
+                queue_enqueue(stress->queue, batch[j]);
+                pthread_cond_broadcast(&stress->queue->nonempty);
+                pthread_mutex_unlock(&stress->queue->mutex);
+            }
+            else {
+                queue_push(stress->queue, batch[j]);
+            }
+        }
+    }
+    return NULL;
 }
 
-void *thread_code(void *args) {
-   
-    queue_enqueue(queue, args);
+void *consumer_thread(void *args) {
+    worker_t *worker = (worker_t *) args;
+    stress_t *stress = worker->stress;
+    queue_t *queue = stress->queue;
+    void *batch[BATCHSIZE], *item;
+    long *last;
+    size_t count, i;
+    int p;
+
+    last = (long *) malloc(stress->producers * sizeof(long));
+    for (p = 0; p < stress->producers; p++) {
+        last[p] = -1;
+    }
 
+    for (;;) {
+        if (stress->mode == MODE_POP) {
+            if ((item = queue_pop(queue)) == NULL)
+                break;
+            take(stress, last, item);
+        }
+        else if (stress->mode == MODE_BATCH) {
+            if ((count = queue_dequeue_batch(queue, batch, BATCHSIZE)) == 0)
+                break;
+            for (i = 0; i < count; i++) {
+                take(stress, last, batch[i]);
+            }
+        }
+        else {
+            // Each consumer owns the producers with its index modulo the count
+            pthread_mutex_lock(&queue->mutex);
+            while (!queue->closed && queue_isempty(queue)) {
+                pthread_cond_wait(&queue->nonempty, &queue->mutex);
+            }
+            if (queue_isempty(queue)) {
+                pthread_mutex_unlock(&queue->mutex);
+                break;
+            }
+            item = (void *) queue_peek(queue);
+            if (item_producer(item) % stress->consumers != worker->index) {
+                pthread_mutex_unlock(&queue->mutex);
+                sched_yield();
+                continue;
+            }
+            if (queue_dequeue(queue) != item)
+                atomic_fetch_add(&stress->foreign, 1);
+            pthread_mutex_unlock(&queue->mutex);
+            take(stress, last, item);
+        }
+    }
+    free(last);
+    return NULL;
 }
 
-void multi_thread_test() {
-    queue = queue_create();
-    int i;
-    pthread_t my_thread;
-    for (i=0; i<10; i++) {
-	int *j = (int *) malloc(sizeof(int));
-	*j = i;
-	pthread_create(&my_thread, NULL, &thread_code, j);
+/**
+ * Runs producers against consumers until every item has been taken, then
+ * checks that nothing was lost, duplicated or reordered.
+ */
+void stress_test(int ring, stress_mode_t mode, int producers, int consumers,
+                 long items) {
+    char name[96], detail[128];
+    pthread_t threads[producers + consumers];
+    worker_t workers[producers + consumers];
+    stress_t stress;
+    long i, lost;
+    int t;
+
+    snprintf(name, sizeof(name), "stress, %s, %s, %d producers, %d consumers",
+             ring ? "ring" : "list", mode_names[mode], producers, consumers);
+    stress.queue = ring ? queue_create_ring(64) : queue_create();
+    stress.mode = mode;
+    stress.producers = producers;
+    stress.consumers = consumers;
+    stress.items = items;
+    stress.seen = (atomic_uchar *) calloc(producers * items,
+                                          sizeof(atomic_uchar));
+    atomic_init(&stress.duplicates, 0);
+    atomic_init(&stress.reordered, 0);
+    atomic_init(&stress.foreign, 0);
+
+    for (t = 0; t < producers + consumers; t++) {
+        workers[t].stress = &stress;
+        workers[t].index = t < producers ? t : t - producers;
+        pthread_create(&threads[t], NULL,
+                       t < producers ? producer_thread : consumer_thread,
+                       &workers[t]);
+    }
+    for (t = 0; t < producers; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    queue_close(stress.queue);
+    for (t = producers; t < producers + consumers; t++) {
+        pthread_join(threads[t], NULL);
     }
-    pthread_exit(0);
+
+    lost = 0;
+    for (i = 0; i < producers * items; i++) {
+        if (atomic_load(&stress.seen[i]) == 0)
+            lost++;
+    }
+    snprintf(detail, sizeof(detail), "%ld lost, %ld duplicated, %ld reordered, "
+             "%ld dequeued another's item", lost,
+             atomic_load(&stress.duplicates), atomic_load(&stress.reordered),
+             atomic_load(&stress.foreign));
+    report(lost == 0 && atomic_load(&stress.duplicates) == 0
+           && atomic_load(&stress.reordered) == 0
+           && atomic_load(&stress.foreign) == 0 && queue_isempty(stress.queue),
+           name, lost || atomic_load(&stress.duplicates)
+                 || atomic_load(&stress.reordered)
+                 || atomic_load(&stress.foreign) ? detail : NULL);
+
+    queue_destroy(stress.queue, NULL);
+    free(stress.seen);
 }
 
+int main(int argc, char **argv) {
+    static const int shapes[][2] = {{1, 1}, {4, 1}, {1, 4}, {4, 4}};
+    long items = argc > 1 ? atol(argv[1]) : 20000;
+    int ring, mode, s;
 
+    single_thread_test(0);
+    single_thread_test(1);
+    for (ring = 0; ring <= 1; ring++) {
+        for (mode = MODE_POP; mode <= MODE_BATCH; mode++) {
+            for (s = 0; s < 4; s++) {
+                stress_test(ring, mode, shapes[s][0], shapes[s][1], items);
+            }
+        }
+    }
+    // Peeking is only safe under the list's mutex
+    for (s = 0; s < 4; s++) {
+        stress_test(0, MODE_PEEK, shapes[s][0], shapes[s][1], items / 4);
+    }
 
-int main (int argc, char **argv) {
-    single_thread_test();
+    node_pool_destroy();
+    printf("%d failed\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
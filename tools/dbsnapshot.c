@@ -0,0 +1,40 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../books.h"
+#include "../snapshot.h"
+
+/**
+ * Compiles a text customer database into a binary snapshot that bookorder can
+ * map at startup instead of parsing the text file again:
+ *
+ *     ./dbsnapshot files/database.txt database.snap
+ *     ./bookorder database.snap files/orders.txt "SPORTS01"
+ *
+ * The snapshot is only readable by builds that agree on its version and record
+ * layout; rebuild it from the text file whenever bookorder rejects it.
+ */
+int main(int argc, char **argv) {
+    database_t *database;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <database.txt> <snapshot>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((database = database_load(argv[1])) == NULL) {
+        fprintf(stderr, "Error: could not load the database %s\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (snapshot_write(database, argv[2]) != 0) {
+        fprintf(stderr, "Error: could not write %s: %s\n", argv[2],
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    printf("%zu customers written to %s\n", database->num_customers, argv[2]);
+
+    database_destroy(database);
+    return EXIT_SUCCESS;
+}
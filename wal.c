@@ -0,0 +1,719 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "books.h"
+#include "wal.h"
+#include "stats.h"
+
+/**
+ * The size of each of the log's two buffers. Appenders wait while the one
+ * being filled is full and the writer still holds the other.
+ */
+#define WAL_BUFFER (1 << 20)
+
+/**
+ * Rounds a record's title up so that the next record stays aligned.
+ */
+#define WAL_PADDED(n) (((n) + 7) & ~(size_t) 7)
+
+/**
+ * Computes the FNV-1a checksum of the given bytes.
+ */
+static uint32_t wal_checksum(const void *data, size_t length) {
+    const unsigned char *p = (const unsigned char *) data;
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Formats the path of a segment or of the checkpoint, which the caller frees.
+ */
+static char *wal_path(const char *path, const char *suffix, long segment) {
+    char *name = (char *) malloc(strlen(path) + strlen(suffix) + 24);
+    if (name) {
+        if (segment >= 0)
+            sprintf(name, "%s.%ld", path, segment);
+        else
+            sprintf(name, "%s.%s", path, suffix);
+    }
+    return name;
+}
+
+/**
+ * Syncs the directory holding the given path, so that files created or
+ * renamed in it survive a crash. Returns 0 on success, or -1 on failure.
+ */
+static int wal_sync_directory(const char *path) {
+    char *copy = strdup(path);
+    int fd, result = -1;
+    if (copy && (fd = open(dirname(copy), O_RDONLY)) >= 0) {
+        result = fsync(fd);
+        close(fd);
+    }
+    free(copy);
+    return result == 0 ? 0 : -1;
+}
+
+/**
+ * Writes the whole buffer, retrying short writes. Returns 0 on success, or -1
+ * on failure.
+ */
+static int wal_write_all(int fd, const char *data, size_t length) {
+    ssize_t count;
+    while (length > 0) {
+        if ((count = write(fd, data, length)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/**
+ * Starts a watermark at the given sequence number and line end.
+ */
+static void wal_mark_init(wal_watermark_t *mark, long sequence, long offset) {
+    mark->sequence = sequence;
+    mark->offset = offset;
+    mark->window = NULL;
+    mark->head = 0;
+    mark->size = 0;
+}
+
+/**
+ * Records that the order with the given sequence number is durable, and moves
+ * the watermark past every durable order right after it. The window doubles
+ * when an order arrives too far ahead of the watermark to fit; if it cannot,
+ * the watermark could never pass the order, so the program exits.
+ */
+static void wal_mark(wal_watermark_t *mark, long sequence, long offset) {
+    size_t distance, i, size;
+    long *window;
+
+    if (sequence < mark->sequence)
+        return;
+    distance = sequence - mark->sequence;
+    if (distance >= mark->size) {
+        size = mark->size ? mark->size : 1024;
+        while (distance >= size)
+            size *= 2;
+        if ((window = (long *) calloc(size, sizeof(long))) == NULL) {
+            fprintf(stderr, "Error: could not allocate the log watermark for "
+                    "order %ld.\n", sequence);
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < mark->size; i++) {
+            window[i] = mark->window[(mark->head + i) & (mark->size - 1)];
+        }
+        free(mark->window);
+        mark->window = window;
+        mark->head = 0;
+        mark->size = size;
+    }
+    mark->window[(mark->head + distance) & (mark->size - 1)] = offset;
+
+    while (mark->window[mark->head]) {
+        mark->offset = mark->window[mark->head];
+        mark->window[mark->head] = 0;
+        mark->head = (mark->head + 1) & (mark->size - 1);
+        mark->sequence++;
+    }
+}
+
+/**
+ * Applies one record from the log to the database, unless its customer had
+ * already applied the order before the checkpoint was taken. A receipt that
+ * cannot be allocated would leave the report disagreeing with the balances,
+ * so the program exits instead.
+ */
+static void wal_replay(database_t *database, const wal_record_t *record,
+                       wal_recovery_t *recovery) {
+    customer_t *customer;
+    receipt_t receipt;
+    int approved = record->status == WAL_APPROVED;
+
+    if (record->status != WAL_APPROVED && record->status != WAL_REJECTED)
+        return;
+    customer = database_retrieve_customer(database, record->customer_id);
+    if (!customer || record->sequence <= customer->last_sequence)
+        return;
+
+    if (approved) {
+        customer->credit_limit = record->credit;
+        customer->spent += record->price;
+    }
+    receipt.title_id = catalog_intern(database->titles,
+                                      (const char *) (record + 1),
+                                      record->title_length);
+    receipt.price = record->price;
+    receipt.remaining_credit = record->credit;
+    receipt.successful = approved;
+    if (!receipt.title_id || customer_add_receipt(customer, &receipt) != 0) {
+        fprintf(stderr, "Error: could not allocate a receipt for customer "
+                "%ld.\n", customer->customer_id);
+        exit(EXIT_FAILURE);
+    }
+    customer->last_sequence = record->sequence;
+    if (record->sequence > recovery->last_sequence)
+        recovery->last_sequence = record->sequence;
+    recovery->replayed++;
+}
+
+/**
+ * Replays every intact record in the given segment. A torn or corrupt record
+ * ends the segment; anything after it was never acknowledged as durable.
+ * Returns -1 if the segment does not exist.
+ */
+static int wal_replay_segment(const char *path, database_t *database,
+                              wal_recovery_t *recovery) {
+    const wal_record_t *record;
+    struct stat info;
+    char *data;
+    size_t position, size;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &info) != 0
+            || (data = (char *) malloc(info.st_size + 1)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    for (position = 0; position < (size_t) info.st_size; ) {
+        ssize_t count = read(fd, data + position, info.st_size - position);
+        if (count <= 0)
+            break;
+        position += count;
+    }
+    close(fd);
+
+    size = position;
+    position = 0;
+    while (position + sizeof(wal_record_t) <= size) {
+        record = (const wal_record_t *) (data + position);
+        if (position + sizeof(wal_record_t)
+                + WAL_PADDED(record->title_length) > size)
+            break;
+        if (record->checksum != wal_checksum(&record->title_length,
+                    sizeof(wal_record_t) - sizeof(uint32_t)
+                    + record->title_length))
+            break;
+        wal_replay(database, record, recovery);
+        wal_mark(&recovery->mark, record->sequence, record->next_offset);
+        position += sizeof(wal_record_t) + WAL_PADDED(record->title_length);
+    }
+    free(data);
+    return 0;
+}
+
+/**
+ * Loads the checkpoint, if there is one, into the database and the recovery.
+ * Returns -1 if the checkpoint exists but cannot be read.
+ */
+static int wal_load_checkpoint(const char *path, database_t *database,
+                               wal_recovery_t *recovery) {
+    wal_checkpoint_t header;
+    wal_checkpoint_customer_t entry;
+    customer_t *customer;
+    FILE *file;
+    int64_t i;
+
+    if ((file = fopen(path, "rb")) == NULL)
+        return errno == ENOENT ? 0 : -1;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, WAL_CHECKPOINT_MAGIC,
+                      sizeof(header.magic)) != 0
+            || header.version != WAL_VERSION) {
+        fclose(file);
+        return -1;
+    }
+    for (i = 0; i < header.num_customers; i++) {
+        if (fread(&entry, sizeof(entry), 1, file) != 1) {
+            fclose(file);
+            return -1;
+        }
+        customer = database_retrieve_customer(database, entry.customer_id);
+        if (!customer)
+            continue;
+        customer->credit_limit = entry.credit_limit;
+        customer->spent = entry.spent;
+        customer->last_sequence = entry.last_sequence;
+        recovery->revenue += entry.spent;
+        if (entry.last_sequence > recovery->last_sequence)
+            recovery->last_sequence = entry.last_sequence;
+    }
+    fclose(file);
+
+    recovery->segment = header.segment;
+    wal_mark_init(&recovery->mark, header.sequence, header.offset);
+    return 0;
+}
+
+/**
+ * Restores the database from the checkpoint, then replays the segments after
+ * it in order until one is missing.
+ */
+int wal_recover(const char *path, database_t *database,
+                wal_recovery_t *recovery) {
+    char *name;
+    int found;
+
+    recovery->last_sequence = -1;
+    recovery->revenue = 0;
+    recovery->segment = 0;
+    recovery->replayed = 0;
+    wal_mark_init(&recovery->mark, 0, 0);
+
+    if ((name = wal_path(path, "ckpt", -1)) == NULL)
+        return -1;
+    found = wal_load_checkpoint(name, database, recovery);
+    free(name);
+    if (found != 0)
+        return -1;
+
+    for (;;) {
+        if ((name = wal_path(path, "", recovery->segment)) == NULL)
+            return -1;
+        found = wal_replay_segment(name, database, recovery);
+        free(name);
+        if (found != 0)
+            break;
+        recovery->segment++;
+    }
+    recovery->sequence = recovery->mark.sequence;
+    recovery->offset = recovery->mark.offset;
+    return 0;
+}
+
+/**
+ * Creates the log segment with the given number. Returns its file descriptor,
+ * or -1 if it cannot be created or its directory entry cannot be synced.
+ */
+static int wal_create_segment(const char *path, long segment) {
+    char *name = wal_path(path, "", segment);
+    int fd;
+    if (!name)
+        return -1;
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    free(name);
+    if (fd >= 0 && wal_sync_directory(path) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Writes every customer that has had an order applied to a new checkpoint,
+ * which replaces the old one atomically. Each customer is read under its lock
+ * stripe, so the workers keep running. Every record in the segments before
+ * the given one was appended, under the same stripe, before its customer was
+ * read, so the checkpoint covers those segments completely. Returns 0 on
+ * success, or -1 on failure.
+ */
+static int wal_write_checkpoint(wal_t *wal, long segment, long sequence,
+                                long offset) {
+    wal_checkpoint_t header;
+    wal_checkpoint_customer_t entry;
+    database_t *database = wal->database;
+    customer_t *customer;
+    char *name, *temp;
+    FILE *file;
+    size_t c;
+    int failed;
+
+    name = wal_path(wal->path, "ckpt", -1);
+    temp = wal_path(wal->path, "ckpt.tmp", -1);
+    if (!name || !temp || (file = fopen(temp, "wb")) == NULL) {
+        free(name);
+        free(temp);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = WAL_VERSION;
+    header.segment = segment;
+    header.sequence = sequence;
+    header.offset = offset;
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (c = 0; c < database->num_customers; c++) {
+        if (!atomic_load(&database->customers[c].loaded))
+            continue;
+        customer = database_customer(database, c);
+        database_lock_customer(database, customer);
+        entry.customer_id = customer->customer_id;
+        entry.last_sequence = customer->last_sequence;
+        entry.credit_limit = customer->credit_limit;
+        entry.spent = customer->spent;
+        database_unlock_customer(database, customer);
+        if (entry.last_sequence < 0)
+            continue;
+        fwrite(&entry, sizeof(entry), 1, file);
+        header.num_customers++;
+    }
+
+    // Now that the count is known, rewrite the header
+    rewind(file);
+    fwrite(&header, sizeof(header), 1, file);
+    failed = fflush(file) != 0 || fsync(fileno(file)) != 0 || ferror(file);
+    if (fclose(file) != 0 || failed || rename(temp, name) != 0) {
+        unlink(temp);
+        free(name);
+        free(temp);
+        return -1;
+    }
+    free(name);
+    free(temp);
+    return wal_sync_directory(wal->path);
+}
+
+/**
+ * Removes the segments before the given one, which a checkpoint now covers.
+ */
+static void wal_remove_segments(wal_t *wal, long segment) {
+    char *name;
+    while (--segment >= 0) {
+        if ((name = wal_path(wal->path, "", segment)) == NULL)
+            return;
+        if (unlink(name) != 0) {
+            free(name);
+            return;
+        }
+        free(name);
+    }
+}
+
+/**
+ * Takes a checkpoint: asks the writer to close the current segment, waits for
+ * it to do so, then writes the checkpoint and removes the old segments. Once
+ * the log is closing the writer may already be gone, so no checkpoint is taken
+ * and wal_close() takes the final one.
+ */
+static void wal_take_checkpoint(wal_t *wal) {
+    long rotations, segment, sequence, offset;
+
+    STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+    if (wal->closing) {
+        pthread_mutex_unlock(&wal->mutex);
+        return;
+    }
+    rotations = wal->rotations;
+    wal->rotate = 1;
+    pthread_cond_signal(&wal->has_records);
+    while (wal->rotations == rotations && !wal->closing)
+        pthread_cond_wait(&wal->rotated, &wal->mutex);
+    if (wal->rotations == rotations) {
+        pthread_mutex_unlock(&wal->mutex);
+        return;
+    }
+    segment = wal->segment;
+    sequence = wal->rotation_sequence;
+    offset = wal->rotation_offset;
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (wal_write_checkpoint(wal, segment, sequence, offset) == 0) {
+        wal_remove_segments(wal, segment);
+        wal->checkpoints++;
+    }
+    else {
+        fprintf(stderr, "Warning: could not write the checkpoint for %s\n",
+                wal->path);
+    }
+}
+
+/**
+ * Code for the checkpointer thread. It sleeps until the writer says enough
+ * records have been logged since the last checkpoint.
+ */
+static void *wal_checkpointer(void *args) {
+    wal_t *wal = (wal_t *) args;
+
+    STATS_THREAD("checkpointer", -1);
+    STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+    for (;;) {
+        while (!wal->checkpoint && !wal->closing)
+            pthread_cond_wait(&wal->checkpoint_due, &wal->mutex);
+        if (wal->closing)
+            break;
+        pthread_mutex_unlock(&wal->mutex);
+        wal_take_checkpoint(wal);
+        STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+        wal->checkpoint = 0;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+/**
+ * Waits until the writer should take the buffer: once it holds a full group,
+ * once the oldest record in it has waited for the sync interval, or when the
+ * log is rotating or closing. Called with the mutex held.
+ */
+static void wal_wait_for_group(wal_t *wal) {
+    struct timespec deadline;
+
+    while (wal->buffered == 0 && !wal->rotate && !wal->closing)
+        pthread_cond_wait(&wal->has_records, &wal->mutex);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wal->sync_interval / 1000;
+    deadline.tv_nsec += (wal->sync_interval % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while ((wal->sync_every == 0 || wal->buffered < wal->sync_every)
+            && !wal->rotate && !wal->closing) {
+        if (pthread_cond_timedwait(&wal->has_records, &wal->mutex,
+                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+}
+
+/**
+ * Code for the writer thread. It swaps the full buffer for its spare one, so
+ * that appenders can carry on while it writes and syncs, then marks every
+ * record it wrote as durable. A record that cannot be written or synced may be
+ * lost while its order has been confirmed, so either failure ends the program.
+ * When closing, it still closes the segment if a rotation is pending.
+ */
+static void *wal_writer(void *args) {
+    wal_t *wal = (wal_t *) args;
+    const wal_record_t *record;
+    char *data;
+    size_t length, position, capacity;
+    long count;
+    int closing, rotating;
+
+    STATS_THREAD("log writer", -1);
+    STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+    for (;;) {
+        wal_wait_for_group(wal);
+        data = wal->buffer;
+        length = wal->length;
+        capacity = wal->capacity;
+        count = wal->buffered;
+        wal->buffer = wal->spare;
+        wal->capacity = wal->spare_capacity;
+        wal->length = 0;
+        wal->buffered = 0;
+        closing = wal->closing;
+        rotating = wal->rotate;
+        pthread_cond_broadcast(&wal->has_room);
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (length > 0) {
+            if (wal_write_all(wal->fd, data, length) != 0) {
+                fprintf(stderr, "Error: could not write to the log %s: %s\n",
+                        wal->path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (wal->sync_every > 0) {
+                if (fdatasync(wal->fd) != 0) {
+                    fprintf(stderr, "Error: could not sync the log %s: %s\n",
+                            wal->path, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                wal->syncs++;
+            }
+            for (position = 0; position < length; ) {
+                record = (const wal_record_t *) (data + position);
+                wal_mark(&wal->mark, record->sequence, record->next_offset);
+                position += sizeof(wal_record_t)
+                            + WAL_PADDED(record->title_length);
+            }
+            wal->groups++;
+        }
+
+        STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+        wal->spare = data;
+        wal->spare_capacity = capacity;
+        wal->records += count;
+        wal->since_checkpoint += count;
+        if (rotating) {
+            if (fsync(wal->fd) != 0) {
+                fprintf(stderr, "Error: could not sync the log %s: %s\n",
+                        wal->path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            close(wal->fd);
+            if ((wal->fd = wal_create_segment(wal->path,
+                                              wal->segment + 1)) < 0) {
+                fprintf(stderr, "Error: could not create a log segment for "
+                        "%s: %s\n", wal->path, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            wal->segment++;
+            wal->rotation_sequence = wal->mark.sequence;
+            wal->rotation_offset = wal->mark.offset;
+            wal->rotate = 0;
+            wal->rotations++;
+            pthread_cond_broadcast(&wal->rotated);
+        }
+        if (wal->checkpoint_every > 0 && !wal->checkpoint
+                && wal->since_checkpoint >= wal->checkpoint_every) {
+            wal->since_checkpoint = 0;
+            wal->checkpoint = 1;
+            pthread_cond_signal(&wal->checkpoint_due);
+        }
+        if (closing && wal->buffered == 0 && !wal->rotate)
+            break;
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+/**
+ * Opens a new segment after the recovered ones and starts the threads. The
+ * log takes over the recovered watermark.
+ */
+wal_t *wal_open(const char *path, database_t *database,
+                wal_recovery_t *recovery, long sync_every, long sync_interval,
+                long checkpoint_every) {
+    wal_t *wal = (wal_t *) calloc(1, sizeof(wal_t));
+    if (!wal)
+        return NULL;
+
+    wal->path = strdup(path);
+    wal->database = database;
+    wal->segment = recovery->segment;
+    wal->sync_every = sync_every;
+    wal->sync_interval = sync_interval > 0 ? sync_interval : 1;
+    wal->checkpoint_every = checkpoint_every;
+    wal->capacity = wal->spare_capacity = WAL_BUFFER;
+    wal->buffer = (char *) malloc(WAL_BUFFER);
+    wal->spare = (char *) malloc(WAL_BUFFER);
+    wal->mark = recovery->mark;
+    wal_mark_init(&recovery->mark, recovery->sequence, recovery->offset);
+    if (!wal->path || !wal->buffer || !wal->spare
+            || (wal->fd = wal_create_segment(path, wal->segment)) < 0) {
+        free(wal->path);
+        free(wal->buffer);
+        free(wal->spare);
+        free(wal->mark.window);
+        free(wal);
+        return NULL;
+    }
+
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->has_records, NULL);
+    pthread_cond_init(&wal->has_room, NULL);
+    pthread_cond_init(&wal->rotated, NULL);
+    pthread_cond_init(&wal->checkpoint_due, NULL);
+    pthread_create(&wal->writer, NULL, wal_writer, wal);
+    pthread_create(&wal->checkpointer, NULL, wal_checkpointer, wal);
+    return wal;
+}
+
+/**
+ * Appends a record for an order to the buffer. The writer is only signalled
+ * when the buffer gets its first record or completes a group. The order has
+ * already been applied, so a record that cannot be allocated would leave the
+ * log behind the database; the program exits instead.
+ */
+void wal_append(wal_t *wal, long sequence, long next_offset, long customer_id,
+                const char *title, int title_length, money_t price,
+                money_t credit, wal_status_t status) {
+    wal_record_t *record;
+    size_t size = sizeof(wal_record_t) + WAL_PADDED(title_length);
+    char *data;
+    int waits = 0;
+
+    STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+    while (wal->length > 0 && wal->length + size > wal->capacity)
+        STATS_COND_WAIT(&wal->has_room, &wal->mutex, waits);
+    if (size > wal->capacity) {
+        // A title longer than the whole buffer
+        if ((data = (char *) realloc(wal->buffer, size)) == NULL) {
+            fprintf(stderr, "Error: could not allocate a log record for order "
+                    "%ld.\n", sequence);
+            exit(EXIT_FAILURE);
+        }
+        wal->buffer = data;
+        wal->capacity = size;
+    }
+
+    record = (wal_record_t *) (wal->buffer + wal->length);
+    memset(record, 0, size);
+    record->title_length = title_length;
+    record->sequence = sequence;
+    record->next_offset = next_offset;
+    record->customer_id = customer_id;
+    record->price = price;
+    record->credit = credit;
+    record->status = status;
+    memcpy(record + 1, title, title_length);
+    record->checksum = wal_checksum(&record->title_length,
+                                    sizeof(wal_record_t) - sizeof(uint32_t)
+                                    + title_length);
+    wal->length += size;
+    wal->buffered++;
+    if (wal->buffered == 1 || wal->buffered == wal->sync_every)
+        pthread_cond_signal(&wal->has_records);
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+/**
+ * Flushes the log and stops its threads, then takes a final checkpoint so that
+ * the next run does not have to replay anything.
+ */
+void wal_close(wal_t *wal) {
+    if (!wal)
+        return;
+
+    STATS_LOCK(&wal->mutex, STATS_LOG_LOCK);
+    wal->closing = 1;
+    pthread_cond_broadcast(&wal->has_records);
+    pthread_cond_broadcast(&wal->checkpoint_due);
+    pthread_cond_broadcast(&wal->rotated);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->writer, NULL);
+    pthread_join(wal->checkpointer, NULL);
+
+    if (fsync(wal->fd) != 0) {
+        fprintf(stderr, "Error: could not sync the log %s: %s\n", wal->path,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(wal->fd);
+    if (wal_write_checkpoint(wal, wal->segment + 1, wal->mark.sequence,
+                             wal->mark.offset) == 0) {
+        wal_remove_segments(wal, wal->segment + 1);
+        wal->checkpoints++;
+    }
+}
+
+/**
+ * Destroys the log, which must have been closed.
+ */
+void wal_destroy(wal_t *wal) {
+    if (!wal)
+        return;
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->has_records);
+    pthread_cond_destroy(&wal->has_room);
+    pthread_cond_destroy(&wal->rotated);
+    pthread_cond_destroy(&wal->checkpoint_due);
+    free(wal->mark.window);
+    free(wal->buffer);
+    free(wal->spare);
+    free(wal->path);
+    free(wal);
+}
@@ -0,0 +1,201 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "books.h"
+
+/**
+ * The first bytes of a checkpoint file.
+ */
+#define WAL_CHECKPOINT_MAGIC "BOOKCKPT"
+
+/**
+ * The checkpoint format version. Bump it whenever the layout of the checkpoint
+ * or of the log records changes.
+ */
+#define WAL_VERSION 2
+
+/**
+ * What happened to a logged order. Skipped orders were never applied, because
+ * their category or customer was unknown or because a previous run had
+ * already applied them; they are logged so that the resume point can move
+ * past them.
+ */
+typedef enum wal_status {
+    WAL_APPROVED = 1,
+    WAL_REJECTED = 2,
+    WAL_SKIPPED = 3
+} wal_status_t;
+
+/**
+ * A record in the log, followed by the title and padding up to a multiple of
+ * eight bytes. The checksum covers everything after itself, so that a record
+ * torn by a crash is detected and ends the replay of its segment. The next
+ * offset is where the order's line ends in the order file. The credit is the
+ * customer's credit after an approved order, or what it would have been after
+ * a rejected one. Amounts are in cents.
+ */
+typedef struct wal_record {
+    uint32_t checksum;
+    uint32_t title_length;
+    int64_t sequence;
+    int64_t next_offset;
+    int64_t customer_id;
+    int64_t price;
+    int64_t credit;
+    int32_t status;
+    int32_t reserved;
+} wal_record_t;
+
+/**
+ * The header of a checkpoint, followed by one wal_checkpoint_customer_t for
+ * every customer that has had an order applied. Every order before the
+ * sequence number is in the checkpoint; its line ends at the offset. Replay
+ * starts with the log segment given.
+ */
+typedef struct wal_checkpoint {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t segment;
+    int64_t sequence;
+    int64_t offset;
+    int64_t num_customers;
+} wal_checkpoint_t;
+
+/**
+ * A customer's balance in a checkpoint, in cents, and the last order applied
+ * to it.
+ */
+typedef struct wal_checkpoint_customer {
+    int64_t customer_id;
+    int64_t last_sequence;
+    int64_t credit_limit;
+    int64_t spent;
+} wal_checkpoint_customer_t;
+
+/**
+ * Tracks the lowest order sequence number not yet known to be durable. Orders
+ * become durable out of order, so those ahead of it are kept in a window,
+ * indexed from the watermark, that holds where each one's line ends; zero
+ * means not yet durable.
+ */
+typedef struct wal_watermark {
+    long sequence;
+    long offset;
+    long *window;
+    size_t head;
+    size_t size;
+} wal_watermark_t;
+
+/**
+ * A write-ahead log of applied orders with group commit. Workers append records
+ * to an in-memory buffer; a writer thread takes the whole buffer at a time,
+ * writes it with one call and syncs it, so that one fsync covers every order
+ * appended since the last one. The writer waits for either enough records or
+ * enough time before each group.
+ *
+ * The log is split into numbered segments, path.0, path.1 and so on. Every so
+ * many records a checkpointer thread asks the writer to start a new segment,
+ * writes the balance of every customer to path.ckpt, and removes the segments
+ * the checkpoint covers.
+ */
+typedef struct wal {
+    char *path;
+    database_t *database;
+    int fd;
+    long segment;
+    long sync_every;
+    long sync_interval;
+    long checkpoint_every;
+    pthread_mutex_t mutex;
+    pthread_cond_t has_records;
+    pthread_cond_t has_room;
+    pthread_cond_t rotated;
+    // Records appended but not yet taken by the writer
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    long buffered;
+    int closing;
+    // Segment rotation for the checkpointer: the watermark when the last
+    // segment was closed
+    int rotate;
+    long rotations;
+    long rotation_sequence;
+    long rotation_offset;
+    // Only touched by the writer
+    char *spare;
+    size_t spare_capacity;
+    wal_watermark_t mark;
+    pthread_t writer;
+    // Checkpoints
+    long since_checkpoint;
+    int checkpoint;
+    pthread_cond_t checkpoint_due;
+    pthread_t checkpointer;
+    // Statistics
+    long records;
+    long groups;
+    long syncs;
+    long checkpoints;
+} wal_t;
+
+/**
+ * The state recovered from a log and its checkpoint: where to resume the order
+ * file, the highest sequence number that any customer has applied, above
+ * which no order can need skipping, and the revenue the checkpoint accounts
+ * for, whose receipts are gone.
+ */
+typedef struct wal_recovery {
+    long sequence;
+    long offset;
+    long last_sequence;
+    money_t revenue;
+    long segment;
+    long replayed;
+    wal_watermark_t mark;
+} wal_recovery_t;
+
+/**
+ * Restores the database from the checkpoint and log at the given path, if
+ * there are any: customers get back their balances and last applied orders,
+ * and receipts are rebuilt for the orders logged since the checkpoint. Returns
+ * 0 on success, even if there was nothing to recover, or -1 if the checkpoint
+ * is unreadable.
+ */
+int wal_recover(const char *, database_t *, wal_recovery_t *);
+
+/**
+ * Opens a new log segment after the recovered ones and starts the writer and
+ * checkpointer threads. Records are synced every given number of records, or
+ * every given number of milliseconds, whichever comes first; a sync count of
+ * zero never syncs and leaves durability to the operating system. A checkpoint
+ * is taken every given number of records, and when the log is closed. Returns NULL if
+ * the segment cannot be created.
+ */
+wal_t *wal_open(const char *, database_t *, wal_recovery_t *, long, long, long);
+
+/**
+ * Appends a record for an order. Workers call this while holding the customer's
+ * lock stripe, so that a customer's records are logged in the order they were
+ * applied. Blocks while the buffer is full.
+ */
+void wal_append(wal_t *, long, long, long, const char *, int, money_t, money_t,
+                wal_status_t);
+
+/**
+ * Writes and syncs every record, takes a final checkpoint, stops the threads
+ * and closes the log. Its statistics stay readable until it is destroyed.
+ */
+void wal_close(wal_t *);
+
+/**
+ * Destroys a closed log, freeing all associated memory.
+ */
+void wal_destroy(wal_t *);
+
+#endif